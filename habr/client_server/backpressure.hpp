@@ -0,0 +1,97 @@
+#ifndef BACKPRESSURE_HPP
+#define BACKPRESSURE_HPP
+
+#include <boost/atomic.hpp>
+#include <string>
+#include <vector>
+
+// What a session does with a new outbound message when its queue is full.
+enum overflow_policy
+{
+    drop_oldest,    // discard queued messages from the front until the new one fits
+    drop_newest,    // discard the new message
+    coalesce,       // merge the queue into one buffer (saves message slots), drop the new one if bytes still overflow
+    disconnect,     // the consumer is too slow: close it
+};
+enum { overflow_policies = disconnect + 1 };
+
+// Bounds on what a session may have queued but not yet handed to the socket.
+struct outbound_limits
+{
+    size_t max_bytes;
+    size_t max_messages;
+    overflow_policy policy;
+};
+
+inline outbound_limits default_outbound_limits()
+{
+    outbound_limits l = { 4 * 1024 * 1024, 16 * 1024, drop_oldest };
+    return l;
+}
+
+inline bool parse_overflow_policy(const std::string &name, overflow_policy &policy)
+{
+    if (name == "drop_oldest") policy = drop_oldest;
+    else if (name == "drop_newest") policy = drop_newest;
+    else if (name == "coalesce") policy = coalesce;
+    else if (name == "disconnect") policy = disconnect;
+    else return false;
+    return true;
+}
+
+inline const char* overflow_policy_name(overflow_policy policy)
+{
+    static const char* const names[overflow_policies] = { "drop_oldest", "drop_newest", "coalesce", "disconnect" };
+    return names[policy];
+}
+
+// Per-session outbound counters. Written only from the session's strand,
+// readable from any thread (relaxed, they are metrics).
+struct outbound_stats
+{
+    boost::atomic<size_t> queued_bytes;
+    boost::atomic<size_t> queued_messages;
+    boost::atomic<unsigned long long> dropped_messages;
+
+    outbound_stats() : queued_bytes(0), queued_messages(0), dropped_messages(0) {}
+};
+
+// A session's FIFO of queued messages. Unlike std::deque, which allocates a
+// block as soon as it is constructed, it owns nothing until the first push,
+// and gives a grown array back once it drains: most sessions are idle.
+template <class T>
+class outbound_queue
+{
+public:
+    typedef typename std::vector<T>::const_iterator const_iterator;
+
+    outbound_queue() : head_(0) {}
+    bool empty() const { return head_ == items_.size(); }
+    size_t size() const { return items_.size() - head_; }
+    const T& front() const { return items_[head_]; }
+    const_iterator begin() const { return items_.begin() + head_; }
+    const_iterator end() const { return items_.end(); }
+    void push_back(const T &item) { items_.push_back(item); }
+    void pop_front()
+    {
+        items_[head_++] = T();
+        if (head_ == items_.size()) clear();
+        else if (head_ >= compact_after && head_ * 2 >= items_.size()) {
+            items_.erase(items_.begin(), items_.begin() + head_);
+            head_ = 0;
+        }
+    }
+    void clear()
+    {
+        head_ = 0;
+        if (items_.capacity() > keep_capacity) std::vector<T>().swap(items_);
+        else items_.clear();
+    }
+
+private:
+    enum { keep_capacity = 16, compact_after = 64 };
+    std::vector<T> items_;
+    size_t head_;
+};
+
+#endif // BACKPRESSURE_HPP
@@ -0,0 +1,54 @@
+// Checks of the outbound overflow policies against a chat_server running in
+// this process. Exits with 1 and says why on the first failed check.
+//
+// build and run: make test
+#include <boost/thread.hpp>
+#include <iostream>
+#include <string>
+#include "chat_server.hpp"
+#include "test_client.hpp"
+#include "transport.hpp"
+
+using namespace boost::asio;
+
+namespace
+{
+// a message larger than max_bytes is dropped by drop_oldest; it must not flush
+// the queue and then be queued over the bound anyway
+void test_drop_oldest_larger_than_bound(io_service &client_service)
+{
+    io_service service;
+    metrics_registry metrics;
+    outbound_limits limits = { 16 * 1024, 16 * 1024, drop_oldest };
+    chat_server<tcp_transport> server(service, metrics, limits);
+    server.listen(ip::tcp::endpoint(ip::address_v4::loopback(), test_port));
+    boost::thread io(boost::bind(&io_service::run, &service));
+
+    test_client receiver(client_service, "receiver");
+    test_client poster(client_service, "poster");
+    poster.post("before");
+    poster.post(std::string(limits.max_bytes + 1, 'x'));
+    poster.post("after");
+    std::string text;
+    check(receiver.next_chat(text) && text == "before", "the message ahead of the oversized one arrives");
+    check(receiver.next_chat(text) && text == "after", "the oversized message is dropped, the next one arrives");
+    check(poster.next_chat(text) && text == "before" && poster.next_chat(text) && text == "after", "the poster's own copies arrive the same way");
+    // the receiver's and the poster's own copy
+    check(server.stats().dropped_messages.value() == 2, "each recipient counts the oversized message as dropped");
+    check(server.stats().overflows[drop_oldest]->value() == 2, "each drop is counted as a drop_oldest overflow");
+
+    server.stop();
+    service.stop();
+    io.join();
+}
+}
+
+int main()
+{
+    // the clients block; a frame that never comes fails the run instead of hanging it
+    alarm(test_timeout);
+    io_service client_service;
+    test_drop_oldest_larger_than_bound(client_service);
+    std::cout << "backpressure_test: ok" << std::endl;
+    return 0;
+}
@@ -0,0 +1,228 @@
+// Broadcast throughput benchmark for server.cpp.
+// Opens `conns` loopback connections, logs every one of them in, then each sends
+// `msgs` messages of `size` bytes. The server fans every message out to every
+// connection, so conns * conns * msgs messages are delivered in total.
+// Start the server with a different pool size (./server 1, ./server 2, ...)
+// and compare the reported messages per second, or pass `server_threads` to
+// run the server linked into the benchmark (libchat_server.a, see `make bench`)
+// so both are built with the same optimization flags. With the `loopback`
+// transport that in-process server is driven through in-memory sockets, which
+// leaves the protocol and fan-out cost without the kernel's network stack.
+//
+// Every heap allocation of the process is counted (operator new is replaced
+// below), so with an in-process server `allocs/msg` is what the server and the
+// clients allocate per delivered message.
+//
+// usage: ./broadcast_bench [conns] [msgs] [size] [threads] [server_threads] [tcp|loopback]
+#include <boost/asio.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/thread.hpp>
+#include <boost/atomic.hpp>
+#include <iostream>
+#include <new>
+#include <vector>
+#include "chat_server.hpp"
+#include "frame.hpp"
+#include "server.hpp"
+#include "transport.hpp"
+
+using namespace boost::asio;
+using namespace boost::placeholders;
+
+// kept out of the way of the server's own globals when it is linked in
+namespace
+{
+boost::atomic<unsigned long long> allocations(0);
+}
+
+void* operator new(size_t size)
+{
+    allocations.fetch_add(1, boost::memory_order_relaxed);
+    if (void *p = malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+namespace
+{
+io_service service;
+
+boost::atomic<unsigned long long> received_msgs(0);
+boost::atomic<unsigned> logged_in(0);
+
+template <class Transport>
+class bench_client : public boost::enable_shared_from_this<bench_client<Transport> >, boost::noncopyable
+{
+    typedef bench_client self_type;
+    bench_client(const std::string &username, unsigned msgs, size_t size)
+        : sock_(service), username_(username), logged_in_(false), msgs_left_(msgs),
+          payload_(encode_post(0, default_room, std::string(size, 'x').c_str(), size)) {}
+public:
+    typedef boost::system::error_code error_code;
+    typedef boost::shared_ptr<bench_client> ptr;
+    static ptr start(const typename Transport::endpoint_type &ep, const std::string &username, unsigned msgs, size_t size)
+    {
+        ptr new_(new bench_client(username, msgs, size));
+        new_->sock_.async_connect(ep, boost::bind(&self_type::on_connect, new_, _1));
+        return new_;
+    }
+    // called once every client got its greeting, so that every broadcast reaches everyone
+    void start_sending()
+    {
+        service.post(boost::bind(&self_type::do_write, this->shared_from_this()));
+    }
+
+private:
+    void on_connect(const error_code &err)
+    {
+        if (err) {
+            std::cerr << username_ << ": connect failed: " << err.message() << "\n";
+            return;
+        }
+        login_ = encode_frame(frame_login, 0, username_);
+        async_write(sock_, buffer(*login_), boost::bind(&self_type::on_login, this->shared_from_this(), _1, _2));
+    }
+    void on_login(const error_code &err, size_t bytes)
+    {
+        if (!err) do_read();
+    }
+    void do_read()
+    {
+        sock_.async_read_some(decoder_.prepare(), boost::bind(&self_type::on_read, this->shared_from_this(), _1, _2));
+    }
+    void on_read(const error_code &err, size_t bytes)
+    {
+        if (err) return;
+        decoder_.commit(bytes);
+        frame f;
+        unsigned long long msgs = 0;
+        while (decoder_.next(f)) {
+            if (f.header.type == frame_chat) ++msgs;
+            else if (f.header.type == frame_hello && !logged_in_) {
+                logged_in_ = true;
+                ++logged_in;
+            }
+        }
+        if (decoder_.error()) {
+            std::cerr << username_ << ": malformed frame\n";
+            return;
+        }
+        received_msgs += msgs;
+        do_read();
+    }
+    void do_write()
+    {
+        if (msgs_left_ == 0) return;
+        --msgs_left_;
+        async_write(sock_, buffer(*payload_), boost::bind(&self_type::on_write, this->shared_from_this(), _1, _2));
+    }
+    void on_write(const error_code &err, size_t bytes)
+    {
+        if (!err) do_write();
+    }
+
+private:
+    typename Transport::socket_type sock_;
+    std::string username_;
+    frame_ptr login_;
+    bool logged_in_;
+    unsigned msgs_left_;
+    frame_ptr payload_;
+    frame_decoder decoder_;
+};
+
+void worker_thread()
+{
+    service.run();
+}
+
+template <class Transport>
+int run_bench(const typename Transport::endpoint_type &ep, unsigned conns, unsigned msgs, size_t size, unsigned threads)
+{
+    typedef bench_client<Transport> client_type;
+    std::vector<typename client_type::ptr> bench_clients;
+    for (unsigned i = 0; i < conns; ++i)
+        bench_clients.push_back(client_type::start(ep, "bench" + std::to_string(i), msgs, size));
+
+    io_service::work work(service);
+    boost::thread_group pool;
+    for (unsigned i = 0; i < threads; ++i)
+        pool.create_thread(worker_thread);
+
+    boost::posix_time::ptime deadline = boost::posix_time::microsec_clock::local_time() + boost::posix_time::seconds(10);
+    while (logged_in < conns && boost::posix_time::microsec_clock::local_time() < deadline)
+        boost::this_thread::sleep(boost::posix_time::millisec(10));
+    if (logged_in < conns) {
+        std::cerr << "only " << logged_in << " of " << conns << " clients logged in\n";
+        service.stop();
+        pool.join_all();
+        return 1;
+    }
+
+    const unsigned long long expected = (unsigned long long)conns * conns * msgs;
+    unsigned long long allocations_before = allocations;
+    boost::posix_time::ptime begin = boost::posix_time::microsec_clock::local_time();
+    deadline = begin + boost::posix_time::seconds(60);
+    for (auto it = bench_clients.begin(), e = bench_clients.end(); it != e; ++it)
+        (*it)->start_sending();
+    while (received_msgs < expected && boost::posix_time::microsec_clock::local_time() < deadline)
+        boost::this_thread::sleep(boost::posix_time::millisec(1));
+    boost::posix_time::ptime end = boost::posix_time::microsec_clock::local_time();
+    unsigned long long allocated = allocations - allocations_before;
+
+    double seconds = (end - begin).total_microseconds() / 1e6;
+    unsigned long long delivered = received_msgs;
+    std::cout << "conns=" << conns << " msgs=" << msgs << " size=" << size
+              << " delivered=" << delivered << "/" << expected
+              << " elapsed=" << seconds << "s"
+              << " rate=" << (unsigned long long)(delivered / seconds) << " msg/s"
+              << " allocs/msg=" << (delivered ? double(allocated) / delivered : 0.0) << "\n";
+
+    service.stop();
+    pool.join_all();
+    return received_msgs < expected ? 1 : 0;
+}
+}
+
+int main(int argc, char const *argv[])
+{
+    unsigned conns = argc > 1 ? atoi(argv[1]) : 50;
+    unsigned msgs = argc > 2 ? atoi(argv[2]) : 100;
+    size_t size = argc > 3 ? atoi(argv[3]) : 64;
+    unsigned threads = argc > 4 ? atoi(argv[4]) : 2;
+    unsigned server_threads = argc > 5 ? atoi(argv[5]) : 0;
+    std::string transport = argc > 6 ? argv[6] : "tcp";
+
+    if (transport == "loopback") {
+        io_service server_service;
+        metrics_registry metrics;
+        chat_server<loopback_transport> server(server_service, metrics);
+        server.listen(loopback_endpoint());
+        boost::thread_group server_pool;
+        for (unsigned i = 0; i < std::max(server_threads, 1u); ++i)
+            server_pool.create_thread(boost::bind(&io_service::run, &server_service));
+        int result = run_bench<loopback_transport>(loopback_endpoint(), conns, msgs, size, threads);
+        server.stop();
+        server_service.stop();
+        server_pool.join_all();
+        return result;
+    }
+
+    boost::thread server;
+    if (server_threads) {
+        std::string threads_arg = std::to_string(server_threads);
+        server = boost::thread([threads_arg] {
+            char const *args[] = { "server", threads_arg.c_str(), "drop_oldest", "4096", "16384", "0" };
+            server_main(6, args);
+        });
+        boost::this_thread::sleep(boost::posix_time::millisec(200));
+    }
+    int result = run_bench<tcp_transport>(ip::tcp::endpoint(ip::address_v4::loopback(), 8001), conns, msgs, size, threads);
+    if (server_threads) {
+        server_shutdown();
+        server.join();
+    }
+    return result;
+}
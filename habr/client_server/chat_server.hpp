@@ -0,0 +1,686 @@
+#ifndef CHAT_SERVER_HPP
+#define CHAT_SERVER_HPP
+
+#include <boost/asio.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/thread/mutex.hpp>
+#include <chrono>
+#include <vector>
+#include "backpressure.hpp"
+#include "frame.hpp"
+#include "history_log.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "pool.hpp"
+#include "rooms.hpp"
+#include "session_registry.hpp"
+#include "transport.hpp"
+
+// The broadcast chat engine behind server.cpp, usable on its own: a
+// chat_server<Transport> owns the session registry, the rooms and the metrics
+// of one listening endpoint and runs on whatever threads run its io_service.
+//
+//   io_service service;
+//   metrics_registry metrics;
+//   chat_server<tcp_transport> server(service, metrics);
+//   server.listen(ip::tcp::endpoint(ip::tcp::v4(), 8001));   // or (ep, acceptors, pending_accepts)
+//   service.run();
+//
+// The transport (tcp_transport, unix_transport, loopback_transport) only
+// decides what the sessions' sockets are, see transport.hpp.
+
+// what chat_server publishes in its metrics_registry
+struct server_stats
+{
+    counter &connections_total;
+    gauge &connections_open;
+    counter &bytes_received;
+    counter &bytes_sent;
+    counter &frames_received;
+    counter &broadcasts_total;
+    histogram &fanout_size;
+    gauge &queued_bytes;
+    counter &dropped_messages;
+    counter &slow_disconnects;
+    histogram &write_batch;
+    histogram &write_latency;
+    counter &history_replayed;
+    gauge &lagging_sessions;
+    // indexed by overflow_policy
+    counter *overflows[overflow_policies];
+
+    explicit server_stats(metrics_registry &metrics)
+        : connections_total(metrics.add_counter("chat_connections_total", "Accepted connections")),
+          connections_open(metrics.add_gauge("chat_connections", "Open connections")),
+          bytes_received(metrics.add_counter("chat_received_bytes_total", "Bytes read from clients")),
+          bytes_sent(metrics.add_counter("chat_sent_bytes_total", "Bytes written to clients")),
+          frames_received(metrics.add_counter("chat_received_frames_total", "Frames decoded from clients")),
+          broadcasts_total(metrics.add_counter("chat_broadcasts_total", "Chat messages fanned out to a room")),
+          fanout_size(metrics.add_histogram("chat_broadcast_fanout", "Recipients per broadcast")),
+          queued_bytes(metrics.add_gauge("chat_outbound_queued_bytes", "Bytes queued for sending over all sessions")),
+          dropped_messages(metrics.add_counter("chat_outbound_dropped_total", "Outbound messages dropped by the overflow policy")),
+          slow_disconnects(metrics.add_counter("chat_slow_consumer_disconnects_total", "Sessions closed by the disconnect overflow policy")),
+          write_batch(metrics.add_histogram("chat_write_batch_messages", "Messages per gathered write")),
+          write_latency(metrics.add_histogram("chat_write_latency_microseconds", "Time from async_write to its completion")),
+          history_replayed(metrics.add_counter("chat_history_replayed_total", "Stored messages sent to catching-up clients")),
+          lagging_sessions(metrics.add_gauge("chat_lagging_sessions", "Sessions that hit an outbound limit and have not drained since"))
+    {
+        for (int p = 0; p < overflow_policies; ++p) {
+            std::string name = overflow_policy_name(overflow_policy(p));
+            overflows[p] = &metrics.add_counter("chat_outbound_overflows_" + name + "_total", "Outbound queue overflows handled by the " + name + " policy");
+        }
+    }
+};
+
+template <class Transport>
+class chat_server;
+
+// The buffers of a gathered write, referenced by the operation rather than
+// copied into it
+struct const_buffer_range
+{
+    typedef boost::asio::const_buffer value_type;
+    typedef const boost::asio::const_buffer* const_iterator;
+
+    const_buffer_range(const std::vector<boost::asio::const_buffer> &bufs) : begin_(bufs.data()), end_(bufs.data() + bufs.size()) {}
+    const_iterator begin() const { return begin_; }
+    const_iterator end() const { return end_; }
+
+private:
+    const_iterator begin_;
+    const_iterator end_;
+};
+
+// One client connection of a chat_server: decodes its frames, joins rooms and
+// fans chat out to them, and drains its own bounded outbound queue.
+// Sessions are slab-allocated and intrusively counted (pool.hpp), and an idle
+// one holds no read buffer: it waits for the socket to become readable and
+// borrows the decoder's buffer only while there is a partial frame in it.
+//
+// Its own operations (the read wait, the write, the inbox drain) run on its
+// strand and capture a plain `this`: a started session keeps itself alive
+// through self_, and lets go of it when it is stopped and the last of them
+// has completed. Their state is allocated from the session's handler_memory.
+template <class Transport>
+class talk_to_client : public pooled_object<talk_to_client<Transport> >
+{
+    typedef chat_server<Transport> server_type;
+    explicit talk_to_client(server_type &server)
+        : server_(server), sock_(server.service()), strand_(server.service()), started_(false), reading_(false),
+          inbox_posted_(false), inbox_closed_(false), write_in_flight_(false), lagging_(false), closing_(false), last_input_(0), id_(0) {}
+public:
+    typedef boost::system::error_code error_code;
+    typedef boost::intrusive_ptr<talk_to_client> ptr;
+    typedef typename Transport::socket_type socket_type;
+    typedef frame_ptr message_ptr;
+    typedef room_table<talk_to_client, ptr> rooms_type;
+    typedef typename rooms_type::room_ptr room_ptr;
+    // a session whose client has sent nothing for this long may be taken over by
+    // a resuming login of its user (see frame_resume). A client that lost its
+    // connection reconnects a second later at the earliest (talk_to_svr's
+    // min_backoff), so its old session has been silent at least that long
+    enum { half_open_after_ms = 1000 };
+    // a catch-up: stored frames to write ahead of the queue, then `done`
+    struct replay
+    {
+        history_batch batch;
+        // frames from a room's memory the batch points into
+        std::vector<message_ptr> recent;
+        message_ptr done;
+    };
+    void start()
+    {
+        started_ = true;
+        last_input_ = now_ms();
+        self_ = ptr(this);
+        id_ = server_.clients().insert(ptr(this));
+        server_.stats().connections_total.inc();
+        server_.stats().connections_open.inc();
+        LOG_DEBUG("client {} started", id_);
+        reading();
+    }
+    static ptr new_(server_type &server)
+    {
+        ptr new_(new talk_to_client(server));
+        return new_;
+    }
+    void stop()
+    {
+        LOG_DEBUG("server, stop() client {}", id_);
+        if (!started_) return;
+        started_ = false;
+        error_code ignored;
+        sock_.close(ignored);
+        server_.stats().connections_open.dec();
+        set_lagging(false);
+        clear_queue();
+        replays_.clear();
+        for (auto it = rooms_.begin(), e = rooms_.end(); it != e; ++it)
+            server_.rooms().leave(*it, id_);
+        rooms_.clear();
+        server_.clients().remove(id_);
+    }
+    void stop_public()
+    {
+        ptr self(this);
+        strand_.post([self] {
+            self->stop();
+            self->release_if_idle();
+        });
+    }
+    // may be called from any thread, see refuse()
+    void refuse_public(const std::string &reason)
+    {
+        ptr self(this);
+        strand_.post([self, reason] {
+            self->refuse(reason);
+            if (!self->started_) self->release_if_idle();
+        });
+    }
+    socket_type& sock() { return sock_; }
+    std::string username() const { return username_; }
+    // may be called from any thread
+    bool half_open() const { return now_ms() - last_input_.load(boost::memory_order_relaxed) >= half_open_after_ms; }
+    // may be called from any thread: the message goes to the session's inbox, and
+    // only the first one since the last drain posts a drain into the strand.
+    // The message is shared, not copied, so a broadcast is encoded once for all recipients
+    void send_message_public(const message_ptr &msg)
+    {
+        {
+            boost::mutex::scoped_lock lk(inbox_mutex_);
+            if (inbox_closed_) return;
+            inbox_.push_back(msg);
+            if (inbox_posted_) return;
+            inbox_posted_ = true;
+        }
+        strand_.post(make_alloc_handler(memory_, [this] { drain_inbox(); }));
+    }
+
+private:
+    void drain_inbox()
+    {
+        {
+            boost::mutex::scoped_lock lk(inbox_mutex_);
+            inbox_.swap(draining_);
+            inbox_posted_ = false;
+        }
+        for (auto it = draining_.begin(), e = draining_.end(); it != e; ++it)
+            send_message(*it);
+        draining_.clear();
+        if (draining_.capacity() > 16) std::vector<message_ptr>().swap(draining_);
+        if (!started_) release_if_idle();
+    }
+    // called last by every handler of a stopped session: drops the session's
+    // hold on itself once nothing is in flight (which may destroy it)
+    void release_if_idle()
+    {
+        if (started_ || reading_ || write_in_flight_) return;
+        {
+            boost::mutex::scoped_lock lk(inbox_mutex_);
+            if (inbox_posted_) return;
+            inbox_closed_ = true;
+            inbox_.clear();
+        }
+        ptr last;
+        last.swap(self_);
+    }
+    // waits for input instead of parking a buffer in an async_read_some;
+    // the socket is non-blocking (Transport::accepted), read_ready reads what came
+    void reading()
+    {
+        reading_ = true;
+        sock_.async_wait(boost::asio::socket_base::wait_read,
+            boost::asio::bind_executor(strand_, make_alloc_handler(memory_, [this](const error_code &err) { read_ready(err); })));
+    }
+    void read_ready(const error_code &err)
+    {
+        reading_ = false;
+        if (err) stop();
+        if (started_) read_input();
+        if (!started_) {
+            LOG_DEBUG("client {} stopped in read_ready", id_);
+            release_if_idle();
+        }
+    }
+    void read_input()
+    {
+        error_code read_err;
+        size_t bytes = sock_.read_some(decoder_.prepare(), read_err);
+        if (read_err == boost::asio::error::would_block) {
+            decoder_.release();
+            reading();
+            return;
+        }
+        if (read_err) {
+            stop();
+            return;
+        }
+        server_.stats().bytes_received.add(bytes);
+        last_input_.store(now_ms(), boost::memory_order_relaxed);
+        decoder_.commit(bytes);
+        frame f;
+        while (decoder_.next(f))
+            on_frame(f);
+        if (decoder_.error()) {
+            LOG_WARN("client {} sent a malformed frame", id_);
+            stop();
+            return;
+        }
+        decoder_.release();
+        reading();
+    }
+    void on_frame(const frame &f)
+    {
+        LOG_TRACE("client {} sent frame type {} length {}", id_, f.header.type, f.header.length);
+        server_.stats().frames_received.inc();
+        // a refused session only waits for its refusal to be written
+        if (closing_) return;
+        if (f.header.type == frame_login) {
+            std::string username(f.payload, std::min<size_t>(f.header.length, 255));
+            // a taken name goes over to a resuming login only from a session that
+            // looks half-open; the side that loses it is refused, so its client
+            // does not come back for it
+            ptr holder = server_.clients().find(username);
+            if (holder && holder.get() != this) {
+                if (!(f.header.flags & frame_resume) || !holder->half_open()) {
+                    LOG_DEBUG("client {} refused: '{}' is taken by client {}", id_, username, holder->id_);
+                    refuse("the name " + username + " is taken");
+                    return;
+                }
+                LOG_DEBUG("client {} takes '{}' over from client {}", id_, username, holder->id_);
+                holder->refuse_public("signed in again elsewhere");
+            }
+            username_ = username;
+            server_.clients().set_username(id_, username_);
+            boost::uint32_t sequence = f.header.sequence;
+            boost::shared_ptr<replay> missed = join_room(default_room, f.header.flags & frame_resume, sequence);
+            send_after(missed, encode_frame(frame_hello, sequence, "hello, " + username + "!"));
+        } else if (f.header.type == frame_join) {
+            boost::uint32_t sequence = f.header.sequence;
+            boost::shared_ptr<replay> missed = join_room(std::string(f.payload, std::min<size_t>(f.header.length, 255)), f.header.flags & frame_resume, sequence);
+            send_after(missed, encode_frame(frame_join, sequence, f.payload, f.header.length));
+        } else if (f.header.type == frame_leave) {
+            leave_room(std::string(f.payload, std::min<size_t>(f.header.length, 255)));
+            send_message(encode_frame(frame_leave, f.header.sequence, f.payload, f.header.length));
+        } else if (f.header.type == frame_chat) {
+            std::string room_name;
+            const char *text;
+            size_t length;
+            if (!decode_post(f, room_name, text, length) || length == 0) return;
+            room_ptr room = find_room(room_name);
+            if (!room) return;
+            // numbered, stored and handed to the members in one step, so the log
+            // and every member see the room's messages in sequence order
+            history_log *history = server_.history();
+            size_t recipients = room->publish([&](boost::uint32_t sequence) {
+                message_ptr msg = encode_chat(sequence, username_, room_name, text, length);
+                if (history) history->append(room_name, msg);
+                return msg;
+            });
+            server_.stats().broadcasts_total.inc();
+            server_.stats().fanout_size.record(recipients);
+            LOG_DEBUG("{} broadcast {} bytes to {} members of '{}'", username_, length, recipients, room_name);
+        } else if (f.header.type == frame_history) {
+            std::string room_name;
+            boost::uint32_t count;
+            if (!decode_history_request(f, room_name, count) || !find_room(room_name)) return;
+            send_history(room_name, f.header.sequence, std::min<boost::uint32_t>(count, max_history), f.header.flags & history_last);
+        }
+    }
+    // tells the client why with a frame_refused and closes the connection once
+    // that is written; the session leaves its rooms and drops what was queued
+    void refuse(const std::string &reason)
+    {
+        if (!started_ || closing_) return;
+        closing_ = true;
+        for (auto it = rooms_.begin(), e = rooms_.end(); it != e; ++it)
+            server_.rooms().leave(*it, id_);
+        rooms_.clear();
+        replays_.clear();
+        clear_queue();
+        send_message(encode_frame(frame_refused, 0, reason));
+        if (!write_in_flight_) stop();
+    }
+    // a catch-up read: the stored frames go out straight from the log's mapped
+    // pages, followed by the request's echo carrying the last sequence sent
+    void send_history(const std::string &room, boost::uint32_t since, size_t count, bool last)
+    {
+        boost::shared_ptr<replay> r = boost::make_shared<replay>();
+        if (server_.history()) {
+            if (last) server_.history()->read_last(room, count, r->batch);
+            else server_.history()->read_since(room, since, count, r->batch);
+        } else r->batch.last_sequence = last ? 0 : since;
+        send_after(r, encode_frame(frame_history, r->batch.last_sequence, room));
+    }
+    // `sequence` is the last one the client has seen of the room, and becomes the
+    // room's sequence at the join (it is left alone if the session is a member
+    // already). A resuming session gets back what it missed: the newer part from
+    // the room's memory, what is older than that from the history log.
+    boost::shared_ptr<replay> join_room(const std::string &name, bool resume, boost::uint32_t &sequence)
+    {
+        typename rooms_type::catch_up_type missed;
+        history_log *history = server_.history();
+        boost::uint32_t since = resume ? sequence : rooms_type::room_type::no_catch_up;
+        room_ptr room = server_.rooms().join(name, id_, ptr(this), history ? history->last_sequence(name) : 0, since, missed);
+        if (!room) return boost::shared_ptr<replay>();
+        rooms_.push_back(room);
+        sequence = missed.sequence;
+        if (!resume) return boost::shared_ptr<replay>();
+        // ahead of the room: the client counted an earlier incarnation of it, see room::join
+        if (since > missed.sequence) since = 0;
+        boost::shared_ptr<replay> r = boost::make_shared<replay>();
+        size_t room_left = max_history - missed.recent.size();
+        if (history && since + 1 < missed.oldest && room_left > 0) {
+            // the newest of what is missing before the room's memory starts
+            if (missed.oldest - 1 - since > room_left) since = missed.oldest - 1 - room_left;
+            history->read_since(name, since, missed.oldest - 1 - since, r->batch);
+            while (!r->batch.frames.empty() && read_frame_header(boost::asio::buffer_cast<const char*>(r->batch.frames.back())).sequence >= missed.oldest)
+                r->batch.frames.pop_back();
+        }
+        r->recent.swap(missed.recent);
+        for (auto it = r->recent.begin(), e = r->recent.end(); it != e; ++it)
+            r->batch.frames.push_back(boost::asio::buffer(**it));
+        LOG_DEBUG("client {} resumed '{}' after {}: {} messages missed", id_, name, since, r->batch.frames.size());
+        return r;
+    }
+    // sends `msg` after the replay, or right away without one
+    void send_after(const boost::shared_ptr<replay> &r, const message_ptr &msg)
+    {
+        if (!r) {
+            send_message(msg);
+            return;
+        }
+        r->done = msg;
+        replays_.push_back(r);
+        if (!write_in_flight_) write_pending();
+    }
+    void leave_room(const std::string &name)
+    {
+        for (auto it = rooms_.begin(), e = rooms_.end(); it != e; ++it)
+            if ((*it)->name() == name) {
+                server_.rooms().leave(*it, id_);
+                rooms_.erase(it);
+                return;
+            }
+    }
+    // only rooms this session has joined can be posted to
+    room_ptr find_room(const std::string &name) const
+    {
+        for (auto it = rooms_.begin(), e = rooms_.end(); it != e; ++it)
+            if ((*it)->name() == name) return *it;
+        return room_ptr();
+    }
+    // queues the message; at most one async_write is in flight per session,
+    // it carries everything that was queued when it started as one gathered write
+    void send_message(message_ptr msg)
+    {
+        if (!started_) return;
+        if (!make_room(msg->size())) return;
+        write_queue_.push_back(msg);
+        count_queued(msg->size());
+        if (!write_in_flight_) write_pending();
+    }
+    // applies the server's overflow policy when `bytes` more would overflow the queue;
+    // false when the new message must not be queued
+    bool make_room(size_t bytes)
+    {
+        const outbound_limits &limits = server_.limits();
+        size_t queued = stats_.queued_bytes.load(boost::memory_order_relaxed);
+        if (queued + bytes <= limits.max_bytes && write_queue_.size() < limits.max_messages) return true;
+        server_.stats().overflows[limits.policy]->inc();
+        set_lagging(true);
+        switch (limits.policy) {
+        case drop_oldest:
+            // more than the whole bound: evicting everything would not make it fit
+            if (bytes > limits.max_bytes) {
+                count_dropped();
+                return false;
+            }
+            while (!write_queue_.empty() && (queued + bytes > limits.max_bytes || write_queue_.size() >= limits.max_messages)) {
+                queued -= write_queue_.front()->size();
+                count_dropped();
+                write_queue_.pop_front();
+            }
+            count_queued((long long)queued - (long long)stats_.queued_bytes.load(boost::memory_order_relaxed));
+            return true;
+        case coalesce:
+            if (write_queue_.size() > 1) coalesce_queue();
+            if (queued + bytes <= limits.max_bytes) return true;
+            count_dropped();
+            return false;
+        case drop_newest:
+            count_dropped();
+            return false;
+        case disconnect:
+            LOG_WARN("disconnecting slow consumer {} ({})", id_, username_);
+            server_.stats().slow_disconnects.inc();
+            stop();
+            return false;
+        }
+        return false;
+    }
+    // frames are self-delimiting, so queued ones can be concatenated into one buffer
+    void coalesce_queue()
+    {
+        boost::shared_ptr<std::string> merged = boost::make_shared<std::string>();
+        merged->reserve(stats_.queued_bytes.load(boost::memory_order_relaxed));
+        for (auto it = write_queue_.begin(), e = write_queue_.end(); it != e; ++it)
+            merged->append(**it);
+        write_queue_.clear();
+        write_queue_.push_back(merged);
+        count_queued(0);
+    }
+    // keeps the session's queue counters and the process-wide gauge in step
+    void count_queued(long long bytes)
+    {
+        stats_.queued_bytes.store(stats_.queued_bytes.load(boost::memory_order_relaxed) + bytes, boost::memory_order_relaxed);
+        stats_.queued_messages.store(write_queue_.size(), boost::memory_order_relaxed);
+        server_.stats().queued_bytes.add(bytes);
+    }
+    // a session lags from its first overflow until its queue drains completely;
+    // the gauge counts lagging sessions, the log says which ones they are
+    void set_lagging(bool lagging)
+    {
+        if (lagging == lagging_) return;
+        lagging_ = lagging;
+        if (lagging) {
+            server_.stats().lagging_sessions.inc();
+            LOG_WARN("client {} ({}) is lagging: {} bytes in {} messages queued, {} dropped so far", id_, username_,
+                     stats_.queued_bytes.load(boost::memory_order_relaxed), stats_.queued_messages.load(boost::memory_order_relaxed),
+                     stats_.dropped_messages.load(boost::memory_order_relaxed));
+        } else {
+            server_.stats().lagging_sessions.dec();
+            if (started_) LOG_INFO("client {} ({}) caught up, {} messages dropped so far", id_, username_, stats_.dropped_messages.load(boost::memory_order_relaxed));
+        }
+    }
+    void count_dropped()
+    {
+        stats_.dropped_messages.fetch_add(1, boost::memory_order_relaxed);
+        server_.stats().dropped_messages.inc();
+    }
+    void clear_queue()
+    {
+        write_queue_.clear();
+        count_queued(-(long long)stats_.queued_bytes.load(boost::memory_order_relaxed));
+    }
+    static long long now_ms()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+    void write_pending()
+    {
+        write_in_flight_ = true;
+        write_started_ = std::chrono::steady_clock::now();
+        if (!replays_.empty()) {
+            replaying_ = replays_.front();
+            replays_.erase(replays_.begin());
+            write_bufs_ = replaying_->batch.frames;
+            write_bufs_.push_back(boost::asio::buffer(*replaying_->done));
+            server_.stats().history_replayed.add(replaying_->batch.frames.size());
+            start_write();
+            return;
+        }
+        long long bytes = 0;
+        while (!write_queue_.empty() && writing_.size() < max_batch) {
+            writing_.push_back(write_queue_.front());
+            write_queue_.pop_front();
+            write_bufs_.push_back(boost::asio::buffer(*writing_.back()));
+            bytes += writing_.back()->size();
+        }
+        count_queued(-bytes);
+        server_.stats().write_batch.record(writing_.size());
+        start_write();
+    }
+    void start_write()
+    {
+        boost::asio::async_write(sock_, const_buffer_range(write_bufs_),
+            boost::asio::bind_executor(strand_, [this](const error_code &err, size_t bytes) { message_sended(err, bytes); }));
+    }
+    void message_sended(const error_code &err, size_t bytes)
+    {
+        write_in_flight_ = false;
+        writing_.clear();
+        write_bufs_.clear();
+        replaying_.reset();
+        server_.stats().write_latency.record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - write_started_).count());
+        server_.stats().bytes_sent.add(bytes);
+        if (err) stop();
+        else if (!replays_.empty() || !write_queue_.empty()) write_pending();
+        else if (closing_) stop();
+        else {
+            set_lagging(false);
+            // a burst's batch arrays are not kept around by an idle session
+            if (writing_.capacity() > 16) {
+                std::vector<message_ptr>().swap(writing_);
+                std::vector<boost::asio::const_buffer>().swap(write_bufs_);
+            }
+        }
+        if (!started_) release_if_idle();
+    }
+
+private:
+    server_type &server_;
+    socket_type sock_;
+    boost::asio::io_service::strand strand_;
+    // the read wait, an inbox drain and a strand hand-off can be in flight at
+    // once. The write's operation (some 500 bytes of buffer state) is left to
+    // asio's per-thread recycling, so idle sessions do not carry a block that big
+    handler_memory<176, 3> memory_;
+    ptr self_;
+    bool started_;
+    bool reading_;
+    // writev() takes at most 64 buffers per call in asio
+    enum { max_batch = 64 };
+    // messages per catch-up request
+    enum { max_history = 1024 };
+    frame_decoder decoder_;
+    boost::mutex inbox_mutex_;
+    std::vector<message_ptr> inbox_;
+    bool inbox_posted_;
+    bool inbox_closed_;
+    std::vector<message_ptr> draining_;
+    outbound_queue<message_ptr> write_queue_;
+    std::vector<message_ptr> writing_;
+    std::vector<boost::asio::const_buffer> write_bufs_;
+    bool write_in_flight_;
+    // catch-up reads waiting for their turn to be written, and the one being written
+    std::vector<boost::shared_ptr<replay> > replays_;
+    boost::shared_ptr<replay> replaying_;
+    std::chrono::steady_clock::time_point write_started_;
+    outbound_stats stats_;
+    bool lagging_;
+    // refused: the connection closes once the frame_refused is written
+    bool closing_;
+    // now_ms() of the last bytes from the client, read by other sessions' logins
+    boost::atomic<long long> last_input_;
+    std::string username_;
+    std::vector<room_ptr> rooms_;
+    typename session_registry<talk_to_client, ptr>::id_type id_;
+};
+
+// Accepts sessions on one endpoint. The server must outlive the handlers it
+// queued, i.e. stop() it and let its io_service run dry (or destroy the
+// io_service first) before destroying it.
+template <class Transport>
+class chat_server : boost::noncopyable
+{
+public:
+    typedef talk_to_client<Transport> session_type;
+    typedef typename session_type::ptr session_ptr;
+    typedef typename Transport::endpoint_type endpoint_type;
+    typedef typename Transport::acceptor_type acceptor_type;
+    typedef session_registry<session_type, session_ptr> registry_type;
+    typedef typename session_type::rooms_type rooms_type;
+
+    // with a history log broadcasts are stored, and clients can catch up on them
+    chat_server(boost::asio::io_service &service, metrics_registry &metrics, const outbound_limits &limits = default_outbound_limits(),
+                history_log *history = 0)
+        : service_(service), stats_(metrics), limits_(limits), history_(history) {}
+
+    // Opens `acceptors` listening sockets on ep, each with `pending_accepts`
+    // accepts outstanding, so a reconnect storm is taken in by several
+    // threads at once instead of one accept per reactor turn. Transports that
+    // cannot share an endpoint get one acceptor.
+    void listen(const endpoint_type &ep, unsigned acceptors = 1, unsigned pending_accepts = 1)
+    {
+        if (!Transport::can_share_endpoint) acceptors = 1;
+        for (unsigned i = 0; i < acceptors; ++i) {
+            acceptors_.push_back(boost::shared_ptr<acceptor_type>(new acceptor_type(service_)));
+            Transport::listen(*acceptors_.back(), ep, acceptors > 1);
+        }
+        for (unsigned i = 0; i < acceptors; ++i)
+            for (unsigned j = 0; j < std::max(pending_accepts, 1u); ++j)
+                accept(*acceptors_[i]);
+    }
+    // may be called from any thread: closes the acceptors and every session
+    void stop()
+    {
+        service_.post(boost::bind(&chat_server::close_acceptors, this));
+        typename registry_type::snapshot_ptr sessions = clients_.sessions();
+        for (auto it = sessions->sessions.begin(), e = sessions->sessions.end(); it != e; ++it)
+            (*it)->stop_public();
+    }
+
+    boost::asio::io_service& service() { return service_; }
+    registry_type& clients() { return clients_; }
+    rooms_type& rooms() { return rooms_; }
+    server_stats& stats() { return stats_; }
+    const outbound_limits& limits() const { return limits_; }
+    history_log* history() { return history_; }
+
+private:
+    void accept(acceptor_type &acceptor)
+    {
+        session_ptr client = session_type::new_(*this);
+        acceptor.async_accept(client->sock(), boost::bind(&chat_server::handle_accept, this, boost::ref(acceptor), client, boost::asio::placeholders::error));
+    }
+    void handle_accept(acceptor_type &acceptor, session_ptr client, const boost::system::error_code &err)
+    {
+        if (err == boost::asio::error::operation_aborted) return;
+        if (!err) {
+            Transport::accepted(client->sock());
+            client->start();
+        }
+        accept(acceptor);
+    }
+    void close_acceptors()
+    {
+        boost::system::error_code ignored;
+        for (auto it = acceptors_.begin(), e = acceptors_.end(); it != e; ++it)
+            (*it)->close(ignored);
+    }
+
+private:
+    boost::asio::io_service &service_;
+    std::vector<boost::shared_ptr<acceptor_type> > acceptors_;
+    registry_type clients_;
+    rooms_type rooms_;
+    server_stats stats_;
+    outbound_limits limits_;
+    history_log *history_;
+};
+
+#endif // CHAT_SERVER_HPP
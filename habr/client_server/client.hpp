@@ -1,10 +1,15 @@
 #include <boost/asio.hpp>
+#include <boost/atomic.hpp>
 #include <boost/bind/bind.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/function.hpp>
+#include <boost/lockfree/spsc_queue.hpp>
 #include <boost/thread.hpp>
-#include <boost/interprocess/sync/scoped_lock.hpp>
-#include <boost/interprocess/sync/interprocess_mutex.hpp>
+#include <algorithm>
 #include <iostream>
+#include <vector>
+#include "frame.hpp"
+#include "message_store.hpp"
 
 #define BUFFER_SIZE 1024 * 5
 
@@ -12,13 +17,35 @@ using namespace boost::asio;
 io_service service;
 using namespace boost::placeholders;
 
+// a message as the GUI shows it
+struct chat_line
+{
+    std::string sender;
+    std::string text;
+    // when it was received
+    std::time_t time;
+};
+
+// The connection runs on the network thread (service.run()), the GUI on its
+// own. They share nothing but two single-producer/single-consumer queues:
+// composed messages go from the GUI to the network thread (send_message), and
+// received ones come back (poll_incoming). Each side wakes the other after
+// pushing: the GUI posts to the io_service, the network thread calls the
+// wake-up given to on_incoming(). Neither ever waits for the other.
 class talk_to_svr : public boost::enable_shared_from_this<talk_to_svr>, boost::noncopyable
 {
     typedef talk_to_svr self_type;
-    talk_to_svr(const std::string &username) : sock_(service), started_(true), username_(username) {}
+    talk_to_svr(const std::string &username)
+        : sock_(service), reconnect_timer_(service), outgoing_(max_outgoing), incoming_(max_incoming),
+          outgoing_posted_(false), incoming_stalled_(false), started_(true), connected_(false), writing_(false),
+          username_(username), out_sequence_(0), resuming_(false), last_seen_(0), backoff_(min_backoff)
+    {
+        write_buffer_[0] = '\0';
+    }
     void start(ip::tcp::endpoint ep)
     {
-        sock_.async_connect(ep, boost::bind(&self_type::on_connect, shared_from_this(), _1));
+        ep_ = ep;
+        sock_.async_connect(ep_, boost::bind(&self_type::on_connect, shared_from_this(), _1));
     }
 public:
     typedef boost::system::error_code error_code;
@@ -34,72 +61,135 @@ public:
         std::cout << "stopping the client\n";
         if (!started_) return;
         started_ = false;
-        sock_.close();
+        error_code ignored;
+        reconnect_timer_.cancel(ignored);
+        sock_.close(ignored);
     }
     bool started() const { return started_; }
     void on_connect(const error_code &err)
     {
-        boost::this_thread::sleep(boost::posix_time::millisec(1000));
-        send_message("login:" + username_);
-        boost::this_thread::sleep(boost::posix_time::millisec(1000));
+        if (!started_) return;
+        if (err) {
+            std::cerr << "on_connect: " << err.message() << "\n";
+            reconnect();
+            return;
+        }
+        connected_ = true;
+        // after a reconnect the server replays what was missed before the hello
+        outbox_.insert(outbox_.begin(), encode_frame(frame_login, last_seen_, username_.data(), username_.size(), resuming_ ? frame_resume : 0));
+        write_outbox();
         read_the_message();
         std::cout << "on_connect called\n";
     }
-    void send_message(std::string msg = "")
-    {
-        if (!started()) return;
-        write_mutex.lock();
-        if (msg != "") {
-            char tmp[BUFFER_SIZE];
-            strncpy(tmp, msg.c_str(), BUFFER_SIZE - 1);
-            sock_.async_write_some(buffer(tmp), 
-                boost::bind(&self_type::message_sended, shared_from_this(), _1, _2));            
-        } else {
-            std::cout << "client, default send_message\n";
-            sock_.async_write_some(buffer(write_buffer_), 
-                boost::bind(&self_type::message_sended, shared_from_this(), _1, _2));
-        }
+
+    // GUI thread: queues a composed message, false if the queue is full
+    bool send_message(const std::string &msg)
+    {
+        if (!started() || msg.empty() || !outgoing_.push(msg)) return false;
+        if (!outgoing_posted_.exchange(true)) service.post(boost::bind(&self_type::take_outgoing, shared_from_this()));
+        return true;
+    }
+    // GUI thread: called with every message received since the last call
+    template <class Handler>
+    void poll_incoming(Handler handler)
+    {
+        chat_line line;
+        while (incoming_.pop(line)) handler(line);
+        // the network thread has messages the queue had no room for
+        if (incoming_stalled_.exchange(false)) service.post(boost::bind(&self_type::flush_incoming, shared_from_this()));
+    }
+    // called on the network thread when poll_incoming has something new; must not block
+    void on_incoming(const boost::function<void()> &wake) { wake_gui_ = wake; }
+
+    void take_outgoing()
+    {
+        outgoing_posted_ = false;
+        std::string msg;
+        while (outgoing_.pop(msg))
+            outbox_.push_back(encode_post(++out_sequence_, default_room, msg.data(), msg.size()));
+        write_outbox();
+    }
+    // what was queued goes out in one write; frames queued meanwhile wait for the next
+    void write_outbox()
+    {
+        if (!connected_ || writing_ || outbox_.empty()) return;
+        out_buffer_.clear();
+        for (std::vector<frame_ptr>::iterator it = outbox_.begin(); it != outbox_.end(); ++it)
+            out_buffer_ += **it;
+        outbox_.clear();
+        writing_ = true;
+        async_write(sock_, buffer(out_buffer_),
+            boost::bind(&self_type::message_sended, shared_from_this(), _1, _2));
     }
     void message_sended(const error_code &err, size_t bytes)
     {
-        write_buffer_[0] = '\0';
-        write_mutex.unlock();
-        std::cout << "client, message have been sended\n";
-        // read_the_message();
-        send_message();
+        writing_ = false;
+        // the connection is gone: the read side reconnects, and what was queued
+        // meanwhile goes out after the next login
+        if (err) return;
+        write_outbox();
     }
     void read_the_message()
     {
-        sock_.async_read_some(buffer(read_buffer_),
+        sock_.async_read_some(decoder_.prepare(),
             boost::bind(&self_type::read_completed, shared_from_this(), _1, _2));
     }
     void read_completed(const error_code &err, size_t bytes)
     {
+        if (!started_) return;
         if (err) {
-            std::cerr << "read_completed: error occured\n";
+            std::cerr << "read_completed: " << err.message() << "\n";
+            reconnect();
+            return;
+        }
+        decoder_.commit(bytes);
+        std::time_t now = std::time(0);
+        bool refused = false;
+        frame f;
+        while (!refused && decoder_.next(f)) {
+            std::string sender, room, msg;
+            if (f.header.type == frame_refused) {
+                // the name is someone else's, or this user signed in elsewhere:
+                // logging in again would only be refused again, or take it back
+                msg.assign(f.payload, f.header.length);
+                refused = true;
+            } else if (f.header.type == frame_hello) {
+                msg.assign(f.payload, f.header.length);
+                // the default room's sequence once the missed messages are in
+                last_seen_ = f.header.sequence;
+                resuming_ = true;
+                backoff_ = min_backoff;
+            } else if (f.header.type != frame_chat || !decode_chat(f, sender, room, msg)) continue;
+            else if (room == default_room) last_seen_ = f.header.sequence;
+            chat_line line;
+            line.sender.swap(sender);
+            line.text.swap(msg);
+            line.time = now;
+            backlog_.push_back(line);
+        }
+        flush_incoming();
+        if (refused) {
+            std::cerr << "read_completed: refused by the server\n";
             stop();
+            return;
+        }
+        if (decoder_.error()) {
+            std::cerr << "read_completed: malformed frame\n";
+            reconnect();
+            return;
         }
-        if (!started_) return;
-        std::string msg(read_buffer_, bytes);
-        // std::string screen_buffer_string(screen_buffer);
-        // screen_buffer_string += username_ + msg + "\n";
-        std::cout << "received: " << msg << std::endl;
-        unsigned int index = strlen(screen_buffer);
-        strncpy(screen_buffer + index, username_.c_str(), 1000);
-        index += strlen(username_.c_str());
-        screen_buffer[index++] = ':';
-        strncpy(screen_buffer + index, read_buffer_, 1000);
-        index = strlen(screen_buffer);
-        screen_buffer[index] = '\n';
-        screen_buffer[index + 1] = '\0';
-        // printf("screen_buffer=%s", screen_buffer);
-        fflush(stdout);
-        // std::cout << msg;
-        // std::cout << "servers message: " << msg;
-        // create_new_message();
-        // send_message();
         read_the_message();
     }
+    // hands received messages to the GUI; what does not fit waits in backlog_
+    // until poll_incoming() has made room
+    void flush_incoming()
+    {
+        size_t pushed = 0;
+        while (pushed < backlog_.size() && incoming_.push(backlog_[pushed])) ++pushed;
+        backlog_.erase(backlog_.begin(), backlog_.begin() + pushed);
+        if (!backlog_.empty()) incoming_stalled_ = true;
+        if (pushed && wake_gui_) wake_gui_();
+    }
     void create_new_message()
     {
         std::string msg(write_buffer_);
@@ -110,20 +200,60 @@ public:
         msg = username_ + ":" + msg + "\n";
         // send_message(msg);
     }
-    char* get_read_buffer() { return read_buffer_; }
+    // both are the GUI thread's own
     char* get_write_buffer() { return write_buffer_; }
-    char* get_screen_buffer() { return screen_buffer; }
-    boost::interprocess::interprocess_mutex& get_mutex() { return write_mutex; }
+    message_store& messages() { return messages_; }
+
+private:
+    // the connection broke: connect again after a pause that doubles up to
+    // max_backoff, and resume the default room after the last message seen
+    void reconnect()
+    {
+        connected_ = false;
+        error_code ignored;
+        sock_.close(ignored);
+        decoder_.reset();
+        std::cerr << "reconnecting in " << backoff_ << " ms\n";
+        reconnect_timer_.expires_from_now(boost::posix_time::millisec(backoff_));
+        reconnect_timer_.async_wait(boost::bind(&self_type::on_reconnect_timer, shared_from_this(), _1));
+        backoff_ = std::min(backoff_ * 2, long(max_backoff));
+    }
+    void on_reconnect_timer(const error_code &err)
+    {
+        if (err || !started_) return;
+        sock_.async_connect(ep_, boost::bind(&self_type::on_connect, shared_from_this(), _1));
+    }
 
 private:
     ip::tcp::socket sock_;
+    ip::tcp::endpoint ep_;
+    deadline_timer reconnect_timer_;
     enum { max_msg = BUFFER_SIZE };
-    char read_buffer_[max_msg];
+    enum { min_backoff = 1000, max_backoff = 30000 };
+    enum { max_outgoing = 256, max_incoming = 4096 };
+    frame_decoder decoder_;
     char write_buffer_[max_msg];
-    bool started_;
+    // GUI -> network and network -> GUI
+    boost::lockfree::spsc_queue<std::string> outgoing_;
+    boost::lockfree::spsc_queue<chat_line> incoming_;
+    boost::atomic<bool> outgoing_posted_;
+    boost::atomic<bool> incoming_stalled_;
+    boost::function<void()> wake_gui_;
+    // the network thread's own
+    std::vector<chat_line> backlog_;
+    std::vector<frame_ptr> outbox_;
+    std::string out_buffer_;
+    // also read by the GUI thread
+    boost::atomic<bool> started_;
+    bool connected_;
+    bool writing_;
     std::string username_;
-    boost::interprocess::interprocess_mutex write_mutex;
-    char screen_buffer[BUFFER_SIZE];
+    boost::uint32_t out_sequence_;
+    // the server has seen this user; last_seen_ is the default room's last sequence received
+    bool resuming_;
+    boost::uint32_t last_seen_;
+    long backoff_;
+    message_store messages_;
 };
 
 // int main(int argc, char const *argv[])
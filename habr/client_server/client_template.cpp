@@ -3,6 +3,8 @@
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/thread.hpp>
 #include <iostream>
+#include <set>
+#include "line_reader.hpp"
 
 using namespace boost::asio;
 io_service service;
@@ -11,7 +13,7 @@ io_service service;
 class talk_to_svr: public boost::enable_shared_from_this<talk_to_svr>, boost::noncopyable
 {
     typedef talk_to_svr self_type;
-    talk_to_svr(const std::string &username) : sock_(service), started_(true), username_(username), timer_(service) {}
+    talk_to_svr(const std::string &username) : sock_(service), started_(true), username_(username), timer_(service), clients_version_(0) {}
     void start(ip::tcp::endpoint ep)
     {
         sock_.async_connect(ep, boost::bind(&self_type::on_connect, shared_from_this(), _1));
@@ -42,11 +44,25 @@ public:
     {
         if (err) stop();
         if (!started()) return;
+        reader_.commit(bytes);
+        const char *line;
+        size_t length;
+        bool answered = false;
+        while (reader_.next(line, length)) {
+            on_line(line, length);
+            answered = true;
+        }
+        if (reader_.overflow()) stop();
+        // only a partial answer so far; otherwise the next request's on_write reads again
+        else if (!answered) do_read();
+    }
+    void on_line(const char *line, size_t length)
+    {
         //process the msg
-        std::string msg(read_buffer_, bytes);
-        if (msg.find("login") == 0) on_login();
-        else if (msg.find("ping") == 0) on_ping(msg);
-        else if (msg.find("clients") == 0) on_clients(msg);
+        if (line_starts_with(line, length, "login")) on_login();
+        else if (line_starts_with(line, length, "ping")) on_ping(std::string(line, length));
+        else if (line_starts_with(line, length, "clients_delta")) on_clients_delta(std::string(line, length));
+        else if (line_starts_with(line, length, "clients")) on_clients(std::string(line, length));
     }
     void on_login()
     {
@@ -60,12 +76,37 @@ public:
         if (answer == "client_list_changed") do_ask_clients();
         else postpone_ping();
     }
+    // "clients <version> name name ...": the whole list
     void on_clients(const std::string &msg)
     {
-        std::string clients = msg.substr(8);
-        std::cout << username_ << ", new client list:" << clients;
+        std::istringstream in(msg);
+        std::string name;
+        in >> name >> clients_version_;
+        clients_.clear();
+        while (in >> name) clients_.insert(name);
+        print_clients();
         postpone_ping();
     }
+    // "clients_delta <version> +joined -left ...": applied to our copy
+    void on_clients_delta(const std::string &msg)
+    {
+        std::istringstream in(msg);
+        std::string change;
+        in >> change >> clients_version_;
+        while (in >> change) {
+            if (change[0] == '+') clients_.insert(change.substr(1));
+            else if (change[0] == '-') clients_.erase(change.substr(1));
+        }
+        print_clients();
+        postpone_ping();
+    }
+    void print_clients()
+    {
+        std::cout << username_ << ", new client list:";
+        for (std::set<std::string>::const_iterator b = clients_.begin(), e = clients_.end(); b != e; ++b)
+            std::cout << " " << *b;
+        std::cout << "\n";
+    }
 
     void do_ping() { do_write("ping\n"); }
     void postpone_ping()
@@ -73,35 +114,41 @@ public:
         timer_.expires_from_now(boost::posix_time::millisec(rand() % 7000));
         timer_.async_wait(boost::bind(&self_type::do_ping, shared_from_this()));
     }
-    void do_ask_clients() { do_write("ask_clients\n"); }
-    void on_write(const error_code &err, size_t bytes) { do_read(); }
+    void do_ask_clients() { do_write("ask_clients " + std::to_string(clients_version_) + "\n"); }
+    void on_write(const error_code &err, size_t bytes)
+    {
+        write_buffer_.clear();
+        if (err) { stop(); return; }
+        if (!pending_.empty()) write_pending();
+        else do_read();
+    }
     void do_read()
     {
-        async_read(sock_, buffer(read_buffer_),
-            boost::bind(&self_type::read_complete, shared_from_this(), _1, _2),
+        sock_.async_read_some(reader_.prepare(),
             boost::bind(&self_type::on_read, shared_from_this(), _1, _2));
     }
     void do_write(const std::string &msg)
     {
         if (!started()) return;
-        std::copy(msg.begin(), msg.end(), write_buffer_);
-        sock_.async_write_some(buffer(write_buffer_, msg.size()), boost::bind(&self_type::on_write, shared_from_this(), _1, _2));
+        pending_ += msg;
+        if (write_buffer_.empty()) write_pending();
     }
 private:
-    size_t read_complete(const boost::system::error_code &err, size_t bytes)
+    void write_pending()
     {
-        if (err) return 0;
-        bool found = std::find(read_buffer_, read_buffer_ + bytes, '\n') < read_buffer_ + bytes;
-        return found ? 0 : 1;
+        write_buffer_.swap(pending_);
+        async_write(sock_, buffer(write_buffer_), boost::bind(&self_type::on_write, shared_from_this(), _1, _2));
     }
 private:
     ip::tcp::socket sock_;
-    enum { max_msg = 1024 };
-    char read_buffer_[max_msg];
-    char write_buffer_[max_msg];
+    line_reader reader_;
+    std::string write_buffer_;
+    std::string pending_;
     bool started_;
     std::string username_;
     deadline_timer timer_;
+    std::set<std::string> clients_;
+    unsigned long long clients_version_;
 };
 
 
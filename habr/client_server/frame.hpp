@@ -0,0 +1,255 @@
+#ifndef FRAME_HPP
+#define FRAME_HPP
+
+#include <boost/asio/buffer.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/cstdint.hpp>
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "read_buffer.hpp"
+
+// The chat wire format: spoken by the engine in chat_server.hpp and by its
+// clients (client.hpp behind the GUI, load_client, the tests' test_client), and
+// stored as is in history_log.
+// Every message is a 12 byte header followed by `length` payload bytes:
+//
+//   0      2      4          8          12
+//   | type | flags | length   | sequence |  payload...
+//
+// all fields big-endian. Frames are self-delimiting, so several of them can be
+// pipelined on one connection and split or coalesced arbitrarily by TCP.
+
+enum frame_type
+{
+    frame_login = 1,    // client -> server, payload: username; joins the default room (see frame_resume)
+    frame_hello = 2,    // server -> client, payload: greeting text; sequence: the default room's
+    frame_chat = 3,     // client -> server: see encode_post; server -> client: see encode_chat
+    frame_join = 4,     // client -> server, payload: room name; echoed back as the ack, with the room's sequence
+    frame_leave = 5,    // client -> server, payload: room name; echoed back as the ack
+    frame_history = 6,  // client -> server: see encode_history_request; the server answers with the
+                        // room's stored chat frames, then echoes the room name with the last sequence sent
+    frame_refused = 7,  // server -> client, payload: why; the server closes the connection after it.
+                        // A client must not log in again with the same name on its own
+};
+
+// frame_history flag: the room's last `count` messages instead of those after a sequence
+enum { history_last = 1 };
+
+// Every room numbers its chat frames 1, 2, ... (the header's sequence). With
+// this flag a frame_login or frame_join resumes a room: its sequence is the
+// last one the client has seen, and the server sends the room's later
+// messages before the hello or the ack (up to the last 1024 of them). The ack
+// carries the room's sequence at the join, after which messages come live.
+// A sequence ahead of the room's was counted before the server restarted
+// (without a history log): the room's messages from its start are sent.
+//
+// A username belongs to one session. A login under a name another session
+// holds is refused (frame_refused), unless it is a resuming login and the
+// holder has gone silent like a connection its client has given up on: then
+// the holder is refused instead and the new session takes the name over.
+enum { frame_resume = 2 };
+
+// the room every session is in after login
+const char* const default_room = "";
+
+enum { frame_header_size = 12 };
+enum { max_frame_payload = 1024 * 64 };
+
+struct frame_header
+{
+    boost::uint16_t type;
+    boost::uint16_t flags;
+    boost::uint32_t length;
+    boost::uint32_t sequence;
+};
+
+// a decoded frame; payload points into the decoder's buffer
+struct frame
+{
+    frame_header header;
+    const char *payload;
+};
+
+// encoded frames are immutable and shared between every queue that sends them
+typedef boost::shared_ptr<const std::string> frame_ptr;
+
+inline void put_u16(char *out, boost::uint16_t v)
+{
+    out[0] = char(v >> 8);
+    out[1] = char(v);
+}
+inline void put_u32(char *out, boost::uint32_t v)
+{
+    out[0] = char(v >> 24);
+    out[1] = char(v >> 16);
+    out[2] = char(v >> 8);
+    out[3] = char(v);
+}
+inline boost::uint16_t get_u16(const char *in)
+{
+    const unsigned char *p = reinterpret_cast<const unsigned char*>(in);
+    return boost::uint16_t((p[0] << 8) | p[1]);
+}
+inline boost::uint32_t get_u32(const char *in)
+{
+    const unsigned char *p = reinterpret_cast<const unsigned char*>(in);
+    return (boost::uint32_t(p[0]) << 24) | (boost::uint32_t(p[1]) << 16) | (boost::uint32_t(p[2]) << 8) | p[3];
+}
+
+inline void write_frame_header(char *out, const frame_header &h)
+{
+    put_u16(out, h.type);
+    put_u16(out + 2, h.flags);
+    put_u32(out + 4, h.length);
+    put_u32(out + 8, h.sequence);
+}
+inline frame_header read_frame_header(const char *in)
+{
+    frame_header h;
+    h.type = get_u16(in);
+    h.flags = get_u16(in + 2);
+    h.length = get_u32(in + 4);
+    h.sequence = get_u32(in + 8);
+    return h;
+}
+
+inline frame_ptr encode_frame(boost::uint16_t type, boost::uint32_t sequence, const char *payload, size_t length, boost::uint16_t flags = 0)
+{
+    frame_header h = { type, flags, boost::uint32_t(length), sequence };
+    boost::shared_ptr<std::string> out = boost::make_shared<std::string>(frame_header_size + length, '\0');
+    write_frame_header(&(*out)[0], h);
+    if (length) memcpy(&(*out)[frame_header_size], payload, length);
+    return out;
+}
+inline frame_ptr encode_frame(boost::uint16_t type, boost::uint32_t sequence, const std::string &payload)
+{
+    return encode_frame(type, sequence, payload.data(), payload.size());
+}
+
+// names (usernames, rooms) are carried as [u8 length][bytes], at most 255 long
+inline void append_name(std::string &payload, const std::string &name)
+{
+    size_t length = std::min<size_t>(name.size(), 255);
+    payload += char(length);
+    payload.append(name, 0, length);
+}
+inline bool read_name(const char *&p, const char *end, std::string &name)
+{
+    if (p >= end) return false;
+    size_t length = static_cast<unsigned char>(*p++);
+    if (size_t(end - p) < length) return false;
+    name.assign(p, length);
+    p += length;
+    return true;
+}
+
+// client -> server chat payload: [u8 room length][room][text]
+inline frame_ptr encode_post(boost::uint32_t sequence, const std::string &room, const char *text, size_t length)
+{
+    std::string payload;
+    payload.reserve(1 + room.size() + length);
+    append_name(payload, room);
+    payload.append(text, length);
+    return encode_frame(frame_chat, sequence, payload);
+}
+// text points into the frame
+inline bool decode_post(const frame &f, std::string &room, const char *&text, size_t &length)
+{
+    const char *p = f.payload, *end = f.payload + f.header.length;
+    if (!read_name(p, end, room)) return false;
+    text = p;
+    length = end - p;
+    return true;
+}
+
+// server -> client chat payload: [u8 sender length][sender][u8 room length][room][text]
+inline frame_ptr encode_chat(boost::uint32_t sequence, const std::string &sender, const std::string &room, const char *text, size_t length)
+{
+    std::string payload;
+    payload.reserve(2 + sender.size() + room.size() + length);
+    append_name(payload, sender);
+    append_name(payload, room);
+    payload.append(text, length);
+    return encode_frame(frame_chat, sequence, payload);
+}
+inline bool decode_chat(const frame &f, std::string &sender, std::string &room, std::string &text)
+{
+    const char *p = f.payload, *end = f.payload + f.header.length;
+    if (!read_name(p, end, sender) || !read_name(p, end, room)) return false;
+    text.assign(p, end);
+    return true;
+}
+
+// client -> server history request payload: [u8 room length][room][u32 count].
+// The header's sequence is the last one the client has seen, messages after it are
+// sent; with `last` the room's last `count` messages are asked for instead
+inline frame_ptr encode_history_request(const std::string &room, boost::uint32_t since, boost::uint32_t count, bool last = false)
+{
+    std::string payload;
+    append_name(payload, room);
+    char n[4];
+    put_u32(n, count);
+    payload.append(n, 4);
+    return encode_frame(frame_history, since, payload.data(), payload.size(), last ? history_last : 0);
+}
+inline bool decode_history_request(const frame &f, std::string &room, boost::uint32_t &count)
+{
+    const char *p = f.payload, *end = f.payload + f.header.length;
+    if (!read_name(p, end, room) || end - p != 4) return false;
+    count = get_u32(p);
+    return true;
+}
+
+// Incremental decoder: read straight into prepare(), commit() what arrived and
+// pop every complete frame with next(). Frames are returned in place, only the
+// trailing partial frame is moved to the front when the buffer runs out of room.
+class frame_decoder
+{
+public:
+    explicit frame_decoder(size_t initial_size = 1024) : buf_(initial_size), error_(false) {}
+
+    // room for at least the rest of a partially received frame
+    boost::asio::mutable_buffers_1 prepare()
+    {
+        size_t need = 1;
+        if (buf_.size() >= frame_header_size) {
+            size_t length = std::min<size_t>(read_frame_header(buf_.data()).length, max_frame_payload);
+            need = std::max<size_t>(need, frame_header_size + length - buf_.size());
+        }
+        return buf_.prepare(need);
+    }
+    void commit(size_t bytes) { buf_.commit(bytes); }
+    // false when no complete frame is buffered or the stream is corrupt (see error())
+    bool next(frame &f)
+    {
+        size_t available = buf_.size();
+        if (error_ || available < frame_header_size) return false;
+        f.header = read_frame_header(buf_.data());
+        if (f.header.length > max_frame_payload) {
+            error_ = true;
+            return false;
+        }
+        if (available < frame_header_size + f.header.length) return false;
+        f.payload = buf_.data() + frame_header_size;
+        buf_.consume(frame_header_size + f.header.length);
+        return true;
+    }
+    bool error() const { return error_; }
+    // gives the input buffer back to the pool unless a partial frame is in it
+    bool release() { return buf_.release(); }
+    // forgets a partial frame and a past error, for a new connection
+    void reset()
+    {
+        buf_.consume(buf_.size());
+        error_ = false;
+    }
+
+private:
+    read_buffer buf_;
+    bool error_;
+};
+
+#endif // FRAME_HPP
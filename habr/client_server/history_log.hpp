@@ -0,0 +1,445 @@
+#ifndef HISTORY_LOG_HPP
+#define HISTORY_LOG_HPP
+
+#include <boost/asio/buffer.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "frame.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+
+// Append-only chat history on disk.
+//
+// The log is a directory of segments, files of `segment_size` bytes named by
+// the log offset of their first record, each mapped into memory whole. A
+// record is the broadcast chat frame exactly as it was sent, behind a small
+// header linking it to the previous record of the same room:
+//
+//   | prev (u64) | size (u32) | 0 (u32) | frame ... | padding to 8 |
+//
+// so a room's records form a chain through the log, and each room keeps a
+// sparse index (every index_every-th of its records: sequence -> offset).
+// "Messages since sequence S" jumps to the index entry at or before S and
+// walks at most one chunk of the chain per index_every records returned;
+// nothing of other rooms is ever looked at.
+//
+// append() only queues the frame: a writer thread copies queued frames into
+// the mapped segment and then syncs them with one msync for the whole batch.
+// Whatever was appended while a sync runs is written and synced together
+// next time (group commit), and the reactor never waits for the disk. The
+// queue holds at most `max_queued` bytes: when the disk falls that far behind,
+// append() drops the frame and counts it (chat_history_dropped_total).
+//
+// Reads return buffers pointing into the mapped pages (history_batch), which
+// the session hands to its socket write as they are. Frames still queued are
+// read too, from the queue, so a read never skips what is about to be written.
+//
+// On start-up existing segments are scanned once to rebuild the chains and
+// the indexes; the scan stops at the first zeroed or damaged record.
+
+class history_segment : boost::noncopyable
+{
+public:
+    history_segment(const std::string &path, boost::uint64_t base, size_t capacity)
+        : base_(base), capacity_(capacity), size_(0), synced_(0), data_(0)
+    {
+        fd_ = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd_ < 0) fail("open " + path);
+        struct stat st;
+        if (::fstat(fd_, &st) < 0) fail("stat " + path);
+        if (size_t(st.st_size) > capacity_) capacity_ = st.st_size;
+        else if (::ftruncate(fd_, capacity_) < 0) fail("ftruncate " + path);
+        void *p = ::mmap(0, capacity_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if (p == MAP_FAILED) fail("mmap " + path);
+        data_ = static_cast<char*>(p);
+    }
+    ~history_segment()
+    {
+        if (data_) ::munmap(data_, capacity_);
+        if (fd_ >= 0) ::close(fd_);
+    }
+
+    boost::uint64_t base() const { return base_; }
+    size_t capacity() const { return capacity_; }
+    char* data() const { return data_; }
+    // bytes holding records; written by the log's writer thread only
+    size_t size() const { return size_; }
+    void set_size(size_t size) { size_ = size; }
+    // writes [synced, size) back to the file
+    void sync()
+    {
+        static const size_t page = ::sysconf(_SC_PAGESIZE);
+        size_t begin = synced_ / page * page;
+        if (size_ > synced_ && ::msync(data_ + begin, size_ - begin, MS_SYNC) < 0)
+            LOG_ERROR("history: msync failed: {}", std::string(strerror(errno)));
+        synced_ = size_;
+    }
+
+private:
+    void fail(const std::string &what)
+    {
+        std::string msg = "history: " + what + ": " + strerror(errno);
+        if (fd_ >= 0) ::close(fd_);
+        throw std::runtime_error(msg);
+    }
+
+private:
+    boost::uint64_t base_;
+    size_t capacity_;
+    size_t size_;
+    size_t synced_;
+    int fd_;
+    char *data_;
+};
+
+typedef boost::shared_ptr<history_segment> history_segment_ptr;
+
+// Frames read from the log, oldest first. The buffers point into mapped
+// segments, which stay mapped as long as the batch holds them.
+struct history_batch
+{
+    std::vector<boost::asio::const_buffer> frames;
+    std::vector<history_segment_ptr> segments;
+    // queued frames the writer had not written yet, which some of the buffers point into
+    std::vector<frame_ptr> pending;
+    // sequence of the last frame, or the `since` asked for when there is none
+    boost::uint32_t last_sequence;
+
+    history_batch() : last_sequence(0) {}
+    bool empty() const { return frames.empty(); }
+    void clear()
+    {
+        frames.clear();
+        segments.clear();
+        pending.clear();
+        last_sequence = 0;
+    }
+};
+
+class history_log : boost::noncopyable
+{
+public:
+    enum { default_segment_size = 64 * 1024 * 1024, default_max_queued = 64 * 1024 * 1024, index_every = 32 };
+
+    history_log(const std::string &dir, metrics_registry &metrics, size_t segment_size = default_segment_size,
+                size_t max_queued = default_max_queued)
+        : dir_(dir), segment_size_(std::max<size_t>(segment_size, 1024 * 1024)), queued_bytes_(0), max_queued_(max_queued), stopping_(false),
+          appended_(metrics.add_counter("chat_history_appended_total", "Messages written to the history log")),
+          syncs_(metrics.add_counter("chat_history_syncs_total", "Group commits (msync calls) of the history log")),
+          commit_batch_(metrics.add_histogram("chat_history_commit_batch", "Messages per group commit")),
+          log_bytes_(metrics.add_gauge("chat_history_bytes", "Bytes of records in the history log")),
+          dropped_(metrics.add_counter("chat_history_dropped_total", "Messages not logged because the write queue was full"))
+    {
+        if (::mkdir(dir_.c_str(), 0755) < 0 && errno != EEXIST)
+            throw std::runtime_error("history: mkdir " + dir_ + ": " + strerror(errno));
+        recover();
+        writer_ = boost::thread(boost::bind(&history_log::run, this));
+    }
+    // writes and syncs what is still queued
+    ~history_log()
+    {
+        {
+            boost::mutex::scoped_lock lk(queue_mutex_);
+            stopping_ = true;
+        }
+        queued_.notify_one();
+        writer_.join();
+    }
+
+    // the room's highest sequence appended so far (or found on disk at
+    // start-up), for a room that is created again to carry on from
+    boost::uint32_t last_sequence(const std::string &room) const
+    {
+        boost::mutex::scoped_lock lk(queue_mutex_);
+        std::unordered_map<std::string, boost::uint32_t>::const_iterator it = last_sequence_.find(room);
+        return it == last_sequence_.end() ? 0 : it->second;
+    }
+    // may be called from any thread, returns at once
+    void append(const std::string &room, const frame_ptr &frame)
+    {
+        {
+            boost::mutex::scoped_lock lk(queue_mutex_);
+            // the room's numbering carries on past a dropped frame
+            last_sequence_[room] = read_frame_header(frame->data()).sequence;
+            if (queued_bytes_ + frame->size() > max_queued_) {
+                dropped_.inc();
+                return;
+            }
+            queue_.push_back(std::make_pair(room, frame));
+            queued_bytes_ += frame->size();
+        }
+        queued_.notify_one();
+    }
+    // up to `limit` of the room's messages with a sequence after `since`, oldest first
+    void read_since(const std::string &room, boost::uint32_t since, size_t limit, history_batch &out) const
+    {
+        boost::mutex::scoped_lock lk(mutex_);
+        out.last_sequence = since;
+        if (limit == 0) return;
+        read_written_since(room, since, limit, out);
+        // the queued ones are newer than anything written
+        boost::mutex::scoped_lock queue_lk(queue_mutex_);
+        for (std::vector<pending>::const_iterator it = queue_.begin(); it != queue_.end() && out.frames.size() < limit; ++it)
+            if (it->first == room && read_frame_header(it->second->data()).sequence > since) add_pending(it->second, out);
+    }
+    // the room's last `count` messages, oldest first
+    void read_last(const std::string &room, size_t count, history_batch &out) const
+    {
+        boost::mutex::scoped_lock lk(mutex_);
+        out.last_sequence = 0;
+        std::vector<frame_ptr> queued;
+        {
+            boost::mutex::scoped_lock queue_lk(queue_mutex_);
+            for (std::vector<pending>::const_iterator it = queue_.begin(); it != queue_.end(); ++it)
+                if (it->first == room) queued.push_back(it->second);
+        }
+        size_t from_queue = std::min(count, queued.size());
+        std::unordered_map<std::string, room_history>::const_iterator r = rooms_.find(room);
+        if (r != rooms_.end()) {
+            std::vector<boost::uint64_t> records;
+            for (boost::uint64_t at = r->second.tail; at != no_record && records.size() < count - from_queue; at = header_at(at).prev)
+                records.push_back(at);
+            for (std::vector<boost::uint64_t>::reverse_iterator it = records.rbegin(); it != records.rend(); ++it)
+                add(*it, out);
+        }
+        for (size_t i = queued.size() - from_queue; i < queued.size(); ++i)
+            add_pending(queued[i], out);
+    }
+
+private:
+    static const boost::uint64_t no_record = ~boost::uint64_t(0);
+    struct record_header
+    {
+        boost::uint64_t prev;
+        boost::uint32_t size;
+        boost::uint32_t reserved;
+    };
+    typedef std::pair<boost::uint32_t, boost::uint64_t> index_entry;
+    struct room_history
+    {
+        boost::uint64_t tail;
+        unsigned long long count;
+        std::vector<index_entry> index;
+
+        room_history() : tail(no_record), count(0) {}
+    };
+    typedef std::pair<std::string, frame_ptr> pending;
+
+    static bool by_sequence(const index_entry &a, const index_entry &b) { return a.first < b.first; }
+    static size_t record_size(size_t frame_size) { return (sizeof(record_header) + frame_size + 7) & ~size_t(7); }
+
+    // the helpers below run with mutex_ held (or before the writer starts)
+    void read_written_since(const std::string &room, boost::uint32_t since, size_t limit, history_batch &out) const
+    {
+        std::unordered_map<std::string, room_history>::const_iterator r = rooms_.find(room);
+        if (r == rooms_.end()) return;
+        const std::vector<index_entry> &index = r->second.index;
+        // the chunk holding the first record after `since`
+        size_t k = std::upper_bound(index.begin(), index.end(), index_entry(since, 0), by_sequence) - index.begin();
+        if (k > 0) --k;
+        std::vector<boost::uint64_t> chunk;
+        for (; k < index.size() && out.frames.size() < limit; ++k) {
+            boost::uint64_t last = k + 1 < index.size() ? header_at(index[k + 1].second).prev : r->second.tail;
+            chunk.clear();
+            for (boost::uint64_t at = last; ; at = header_at(at).prev) {
+                chunk.push_back(at);
+                if (at == index[k].second) break;
+            }
+            for (std::vector<boost::uint64_t>::reverse_iterator it = chunk.rbegin(); it != chunk.rend() && out.frames.size() < limit; ++it)
+                if (sequence_at(*it) > since) add(*it, out);
+        }
+    }
+    const history_segment_ptr& segment_at(boost::uint64_t offset) const
+    {
+        size_t i = segments_.size() - 1;
+        while (i > 0 && segments_[i]->base() > offset) --i;
+        return segments_[i];
+    }
+    record_header header_at(boost::uint64_t offset) const
+    {
+        const history_segment &s = *segment_at(offset);
+        record_header h;
+        memcpy(&h, s.data() + (offset - s.base()), sizeof(h));
+        return h;
+    }
+    boost::uint32_t sequence_at(boost::uint64_t offset) const
+    {
+        const history_segment &s = *segment_at(offset);
+        return read_frame_header(s.data() + (offset - s.base()) + sizeof(record_header)).sequence;
+    }
+    void add(boost::uint64_t offset, history_batch &out) const
+    {
+        const history_segment_ptr &s = segment_at(offset);
+        const char *record = s->data() + (offset - s->base());
+        record_header h;
+        memcpy(&h, record, sizeof(h));
+        out.frames.push_back(boost::asio::const_buffer(record + sizeof(h), h.size));
+        if (out.segments.empty() || out.segments.back() != s) out.segments.push_back(s);
+        out.last_sequence = read_frame_header(record + sizeof(h)).sequence;
+    }
+    void add_pending(const frame_ptr &frame, history_batch &out) const
+    {
+        out.frames.push_back(boost::asio::buffer(*frame));
+        out.pending.push_back(frame);
+        out.last_sequence = read_frame_header(frame->data()).sequence;
+    }
+    void link(const std::string &room, boost::uint64_t offset, boost::uint32_t sequence)
+    {
+        room_history &r = rooms_[room];
+        if (r.count++ % index_every == 0) r.index.push_back(index_entry(sequence, offset));
+        r.tail = offset;
+    }
+    std::string segment_path(boost::uint64_t base) const
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "%020llu.log", (unsigned long long)base);
+        return dir_ + "/" + name;
+    }
+    history_segment_ptr open_segment(boost::uint64_t base)
+    {
+        return history_segment_ptr(new history_segment(segment_path(base), base, segment_size_));
+    }
+    void write_record(const std::string &room, const std::string &frame)
+    {
+        size_t need = record_size(frame.size());
+        history_segment_ptr s = segments_.back();
+        if (s->size() + need > s->capacity()) {
+            s = open_segment(s->base() + s->size());
+            segments_.push_back(s);
+        }
+        room_history &r = rooms_[room];
+        char *record = s->data() + s->size();
+        record_header h = { r.tail, boost::uint32_t(frame.size()), 0 };
+        memcpy(record + sizeof(h), frame.data(), frame.size());
+        memcpy(record, &h, sizeof(h));
+        link(room, s->base() + s->size(), read_frame_header(frame.data()).sequence);
+        s->set_size(s->size() + need);
+        log_bytes_.add(need);
+    }
+    // rebuilds the chains and indexes from the segments on disk
+    void recover()
+    {
+        std::vector<boost::uint64_t> bases;
+        if (DIR *d = ::opendir(dir_.c_str())) {
+            while (struct dirent *e = ::readdir(d)) {
+                unsigned long long base;
+                char tail[8];
+                if (sscanf(e->d_name, "%llu.%7s", &base, tail) == 2 && strcmp(tail, "log") == 0) bases.push_back(base);
+            }
+            ::closedir(d);
+        }
+        std::sort(bases.begin(), bases.end());
+        for (std::vector<boost::uint64_t>::iterator it = bases.begin(); it != bases.end(); ++it) {
+            history_segment_ptr s = open_segment(*it);
+            size_t at = 0;
+            bool damaged = false;
+            while (at + sizeof(record_header) + frame_header_size <= s->capacity()) {
+                record_header h;
+                memcpy(&h, s->data() + at, sizeof(h));
+                if (h.size == 0) break;
+                const char *bytes = s->data() + at + sizeof(h);
+                frame f;
+                std::string sender, room, text;
+                damaged = h.size < frame_header_size || at + record_size(h.size) > s->capacity();
+                if (!damaged) {
+                    f.header = read_frame_header(bytes);
+                    f.payload = bytes + frame_header_size;
+                    damaged = f.header.type != frame_chat || frame_header_size + f.header.length != h.size || !decode_chat(f, sender, room, text)
+                              || h.prev != rooms_[room].tail;
+                }
+                if (damaged) break;
+                link(room, s->base() + at, f.header.sequence);
+                last_sequence_[room] = f.header.sequence;
+                at += record_size(h.size);
+            }
+            s->set_size(at);
+            segments_.push_back(s);
+            log_bytes_.add(at);
+            // a torn write: the rest of this segment and the later ones cannot be trusted
+            if (damaged) {
+                LOG_WARN("history: damaged record at {} in {}, dropping what follows", s->base() + at, dir_);
+                memset(s->data() + at, 0, s->capacity() - at);
+                for (++it; it != bases.end(); ++it) ::unlink(segment_path(*it).c_str());
+                break;
+            }
+        }
+        if (segments_.empty()) segments_.push_back(open_segment(0));
+        for (std::vector<history_segment_ptr>::iterator it = segments_.begin(); it != segments_.end(); ++it) (*it)->sync();
+        LOG_INFO("history: {} rooms, {} bytes in {}", rooms_.size(), log_bytes_.value(), dir_);
+    }
+    void run()
+    {
+        std::vector<pending> batch;
+        std::vector<history_segment_ptr> dirty;
+        for (;;) {
+            {
+                boost::mutex::scoped_lock lk(queue_mutex_);
+                while (queue_.empty() && !stopping_) queued_.wait(lk);
+                if (queue_.empty()) return;
+            }
+            {
+                // frames leave the queue and land in the mapping under mutex_, so a
+                // reader finds each of them in one place or the other
+                boost::mutex::scoped_lock lk(mutex_);
+                {
+                    boost::mutex::scoped_lock queue_lk(queue_mutex_);
+                    batch.swap(queue_);
+                    queued_bytes_ = 0;
+                }
+                size_t first = segments_.size() - 1;
+                for (std::vector<pending>::iterator it = batch.begin(); it != batch.end(); ++it)
+                    write_record(it->first, *it->second);
+                dirty.assign(segments_.begin() + first, segments_.end());
+            }
+            // the disk wait is outside the lock: readers go on, appends queue up for the next commit
+            for (std::vector<history_segment_ptr>::iterator it = dirty.begin(); it != dirty.end(); ++it) (*it)->sync();
+            syncs_.inc();
+            commit_batch_.record(batch.size());
+            appended_.add(batch.size());
+            batch.clear();
+        }
+    }
+
+private:
+    std::string dir_;
+    size_t segment_size_;
+
+    mutable boost::mutex mutex_;
+    std::vector<history_segment_ptr> segments_;
+    std::unordered_map<std::string, room_history> rooms_;
+
+    // taken after mutex_ when both are held
+    mutable boost::mutex queue_mutex_;
+    boost::condition_variable queued_;
+    std::vector<pending> queue_;
+    size_t queued_bytes_;
+    size_t max_queued_;
+    std::unordered_map<std::string, boost::uint32_t> last_sequence_;
+    bool stopping_;
+    boost::thread writer_;
+
+    counter &appended_;
+    counter &syncs_;
+    histogram &commit_batch_;
+    gauge &log_bytes_;
+    counter &dropped_;
+};
+
+#endif // HISTORY_LOG_HPP
@@ -0,0 +1,63 @@
+// Checks of history_log in a scratch directory. Exits with 1 and says why on
+// the first failed check.
+//
+// build and run: make test
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include "history_log.hpp"
+#include "test_client.hpp"
+
+namespace
+{
+// a scratch log directory, removed afterwards
+struct scratch_dir
+{
+    std::string path;
+
+    scratch_dir()
+    {
+        char name[] = "/tmp/history_test.XXXXXX";
+        check(mkdtemp(name) != 0, "a scratch directory is made");
+        path = name;
+    }
+    ~scratch_dir() { check(system(("rm -rf " + path).c_str()) == 0, "the scratch directory is removed"); }
+};
+
+// reads return what was appended whether or not the writer thread has got to it yet
+void test_reads_see_queued_frames()
+{
+    scratch_dir dir;
+    metrics_registry metrics;
+    history_log log(dir.path, metrics);
+    for (boost::uint32_t sequence = 1; sequence <= 5000; ++sequence) {
+        log.append("room", encode_chat(sequence, "sender", "room", "x", 1));
+        if (sequence % 50) continue;
+        history_batch since, last;
+        log.read_since("room", 0, sequence, since);
+        log.read_last("room", 30, last);
+        check(since.frames.size() == sequence && since.last_sequence == sequence, "read_since returns every appended frame");
+        check(last.frames.size() == 30 && last.last_sequence == sequence, "read_last ends with the last appended frame");
+    }
+}
+
+// past max_queued bytes append() drops the frame, counts it, and the numbering goes on
+void test_full_queue_drops()
+{
+    scratch_dir dir;
+    metrics_registry metrics;
+    frame_ptr frame = encode_chat(1, "sender", "room", "x", 1);
+    history_log log(dir.path, metrics, history_log::default_segment_size, frame->size() - 1);
+    log.append("room", frame);
+    check(metrics.render().find("\nchat_history_dropped_total 1\n") != std::string::npos, "the frame is counted as dropped");
+    check(log.last_sequence("room") == 1, "the room's last sequence counts the dropped frame");
+}
+}
+
+int main()
+{
+    test_reads_see_queued_frames();
+    test_full_queue_drops();
+    std::cout << "history_test: ok" << std::endl;
+    return 0;
+}
@@ -0,0 +1,52 @@
+#ifndef LINE_READER_HPP
+#define LINE_READER_HPP
+
+#include <cstring>
+#include "read_buffer.hpp"
+
+// Splits the newline-delimited protocol of server_template.cpp/client_template.cpp.
+// A read takes everything the socket has; next() then pops every complete line
+// from the buffer. The delimiter search is memchr (vectorised in libc) and never
+// rescans bytes already known not to contain '\n'.
+class line_reader
+{
+public:
+    enum { max_line = 1024 * 64 };
+
+    explicit line_reader(size_t initial_size = 1024) : buf_(initial_size), scanned_(0), overflow_(false) {}
+
+    boost::asio::mutable_buffers_1 prepare() { return buf_.prepare(); }
+    void commit(size_t bytes) { buf_.commit(bytes); }
+    // line without its '\n'; valid until the next prepare()
+    bool next(const char *&line, size_t &length)
+    {
+        if (overflow_) return false;
+        const char *begin = buf_.data();
+        const char *end = static_cast<const char*>(memchr(begin + scanned_, '\n', buf_.size() - scanned_));
+        if (!end) {
+            scanned_ = buf_.size();
+            if (scanned_ > max_line) overflow_ = true;
+            return false;
+        }
+        line = begin;
+        length = end - begin;
+        buf_.consume(length + 1);
+        scanned_ = 0;
+        return true;
+    }
+    // a line grew beyond max_line; the peer is broken or hostile
+    bool overflow() const { return overflow_; }
+
+private:
+    read_buffer buf_;
+    size_t scanned_;
+    bool overflow_;
+};
+
+inline bool line_starts_with(const char *line, size_t length, const char *prefix)
+{
+    size_t n = strlen(prefix);
+    return length >= n && memcmp(line, prefix, n) == 0;
+}
+
+#endif // LINE_READER_HPP
@@ -0,0 +1,419 @@
+// Load generator for server.cpp, grown out of client_template.cpp's talk_to_svr.
+// Opens `conns` loopback connections at `ramp` per second, spreads them over
+// `rooms` rooms and lets each one post `size` byte messages `rate` times a
+// second. Every message carries its send time, so every copy the server fans
+// out yields one end-to-end latency sample. After `duration` seconds of
+// measurement the results are printed as one JSON object, ready to be diffed
+// between server builds.
+//
+// usage: ./load_client [key=value ...]
+//   conns=100     connections
+//   ramp=200      new connections per second (0: all at once)
+//   size=64       message size in bytes (at least 8, the timestamp)
+//   rate=10       messages per second per connection (0: back to back)
+//   rooms=1       rooms to spread connections over (0: the default room only)
+//   skew=0        zipf exponent of the room distribution (0: uniform)
+//   duration=10   seconds of measurement (0: only connect, to time a reconnect storm with ramp=0)
+//   hold=0        seconds to keep the connections open, idle, before closing them
+//   threads=2     io threads
+//   port=8001     server port on 127.0.0.1
+//   seed=1        random seed for the room assignment
+//   transport=tcp tcp, unix:<path> for server.cpp's Unix socket, or loopback
+//                 to run the server in this process over in-memory sockets
+//   server_threads=1  io threads of that in-process server
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/atomic.hpp>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <random>
+#include <thread>
+#include <vector>
+#include "chat_server.hpp"
+#include "frame.hpp"
+#include "metrics.hpp"
+#include "transport.hpp"
+
+using namespace boost::asio;
+using namespace boost::placeholders;
+io_service service;
+
+typedef std::chrono::steady_clock load_clock;
+
+struct load_config
+{
+    unsigned conns;
+    unsigned ramp;
+    size_t size;
+    unsigned rate;
+    unsigned rooms;
+    double skew;
+    unsigned duration;
+    unsigned threads;
+    unsigned short port;
+    unsigned seed;
+    std::string transport;
+    unsigned server_threads;
+    unsigned hold;
+
+    load_config() : conns(100), ramp(200), size(64), rate(10), rooms(1), skew(0), duration(10), threads(2), port(8001), seed(1),
+                    transport("tcp"), server_threads(1), hold(0) {}
+};
+
+bool parse_config(int argc, char const *argv[], load_config &c)
+{
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        size_t eq = arg.find('=');
+        if (eq == std::string::npos) return false;
+        std::string key = arg.substr(0, eq);
+        const char *value = argv[i] + eq + 1;
+        if (key == "conns") c.conns = atoi(value);
+        else if (key == "ramp") c.ramp = atoi(value);
+        else if (key == "size") c.size = atoi(value);
+        else if (key == "rate") c.rate = atoi(value);
+        else if (key == "rooms") c.rooms = atoi(value);
+        else if (key == "skew") c.skew = atof(value);
+        else if (key == "duration") c.duration = atoi(value);
+        else if (key == "threads") c.threads = atoi(value);
+        else if (key == "port") c.port = atoi(value);
+        else if (key == "seed") c.seed = atoi(value);
+        else if (key == "transport") c.transport = value;
+        else if (key == "server_threads") c.server_threads = atoi(value);
+        else if (key == "hold") c.hold = atoi(value);
+        else return false;
+    }
+    c.size = std::max<size_t>(c.size, 8);
+    return c.conns > 0 && c.threads > 0 && c.server_threads > 0;
+}
+
+// samples are only taken for messages sent inside [window_begin, window_end)
+boost::atomic<long long> window_begin(-1);
+boost::atomic<long long> window_end(-1);
+boost::atomic<bool> sending(true);
+boost::atomic<bool> stopping(false);
+boost::atomic<unsigned> ready(0);
+boost::atomic<unsigned> failed(0);
+boost::atomic<unsigned> disconnected(0);
+counter delivered;
+histogram latency;
+
+inline long long now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(load_clock::now().time_since_epoch()).count();
+}
+inline bool in_window(long long t)
+{
+    long long begin = window_begin.load(boost::memory_order_relaxed);
+    long long end = window_end.load(boost::memory_order_relaxed);
+    return begin >= 0 && t >= begin && (end < 0 || t < end);
+}
+
+inline void tune_socket(ip::tcp::socket &sock) { sock.set_option(ip::tcp::no_delay(true)); }
+template <class Socket>
+inline void tune_socket(Socket &) {}
+
+template <class Transport>
+class talk_to_svr: public boost::enable_shared_from_this<talk_to_svr<Transport> >, boost::noncopyable
+{
+    typedef talk_to_svr self_type;
+    talk_to_svr(const std::string &username, const std::string &room, const load_config &config)
+        : sock_(service), strand_(service), timer_(service), started_(true), username_(username), room_(room),
+          interval_(config.rate ? std::chrono::nanoseconds(1000000000LL / config.rate) : std::chrono::nanoseconds(0)),
+          text_(config.size, 'x'), sequence_(0), sent_(0) {}
+    void start(const typename Transport::endpoint_type &ep)
+    {
+        sock_.async_connect(ep, strand_.wrap(boost::bind(&self_type::on_connect, this->shared_from_this(), _1)));
+    }
+public:
+    typedef boost::system::error_code error_code;
+    typedef boost::shared_ptr<talk_to_svr> ptr;
+    static ptr start(const typename Transport::endpoint_type &ep, const std::string &username, const std::string &room, const load_config &config)
+    {
+        ptr new_(new talk_to_svr(username, room, config));
+        new_->start(ep);
+        return new_;
+    }
+    void stop()
+    {
+        if (!started_) return;
+        started_ = false;
+        error_code ignored;
+        timer_.cancel(ignored);
+        sock_.close(ignored);
+    }
+    void stop_public() { strand_.post(boost::bind(&self_type::stop, this->shared_from_this())); }
+    const std::string& room() const { return room_; }
+    // messages sent inside the measurement window
+    unsigned long long sent() const { return sent_.load(boost::memory_order_relaxed); }
+
+private:
+    void on_connect(const error_code &err)
+    {
+        if (err) {
+            ++failed;
+            started_ = false;
+            return;
+        }
+        tune_socket(sock_);
+        do_write(encode_frame(frame_login, 0, username_));
+        do_read();
+    }
+    void on_read(const error_code &err, size_t bytes)
+    {
+        if (err) {
+            if (started_ && !stopping) ++disconnected;
+            stop();
+        }
+        if (!started_) return;
+        decoder_.commit(bytes);
+        frame f;
+        while (decoder_.next(f)) on_frame(f);
+        if (decoder_.error()) {
+            stop();
+            return;
+        }
+        do_read();
+    }
+    void on_frame(const frame &f)
+    {
+        if (f.header.type == frame_chat) on_chat(f);
+        else if (f.header.type == frame_hello) on_login();
+        else if (f.header.type == frame_join) on_ready();
+    }
+    void on_login()
+    {
+        if (room_ == default_room) on_ready();
+        else do_write(encode_frame(frame_join, 0, room_));
+    }
+    void on_ready()
+    {
+        ++ready;
+        next_send_ = load_clock::now();
+        do_send();
+    }
+    // [u8 sender length][sender][u8 room length][room][u64 send time][filler]
+    void on_chat(const frame &f)
+    {
+        const char *p = f.payload, *end = f.payload + f.header.length;
+        for (int field = 0; field < 2; ++field) {
+            if (p == end || end - p < 1 + (unsigned char)*p) return;
+            p += 1 + (unsigned char)*p;
+        }
+        if (end - p < 8) return;
+        long long sent = ((long long)get_u32(p) << 32) | get_u32(p + 4);
+        if (!in_window(sent)) return;
+        delivered.inc();
+        latency.record((now_ns() - sent) / 1000);
+    }
+
+    // with a fixed rate the timestamp is the scheduled send time, not the
+    // actual one, so a stalled connection shows up as latency instead of
+    // silently lowering the offered load
+    void do_send()
+    {
+        if (!started_ || !sending) return;
+        long long stamp = interval_.count() ? std::chrono::duration_cast<std::chrono::nanoseconds>(next_send_.time_since_epoch()).count() : now_ns();
+        put_u32(&text_[0], boost::uint32_t(stamp >> 32));
+        put_u32(&text_[4], boost::uint32_t(stamp));
+        if (in_window(stamp)) sent_.fetch_add(1, boost::memory_order_relaxed);
+        do_write(encode_post(++sequence_, room_, text_.data(), text_.size()));
+    }
+    void on_send_due(const error_code &err)
+    {
+        if (!err) do_send();
+    }
+    void schedule_send()
+    {
+        if (!started_ || !sending) return;
+        if (!interval_.count()) {
+            do_send();
+            return;
+        }
+        next_send_ += interval_;
+        timer_.expires_at(next_send_);
+        timer_.async_wait(strand_.wrap(boost::bind(&self_type::on_send_due, this->shared_from_this(), _1)));
+    }
+
+    void on_write(const error_code &err, size_t bytes)
+    {
+        bool was_post = writing_ && get_u16(writing_->data()) == frame_chat;
+        writing_.reset();
+        if (err) {
+            stop();
+            return;
+        }
+        if (!pending_.empty()) {
+            frame_ptr next = pending_.front();
+            pending_.erase(pending_.begin());
+            write_frame(next);
+        }
+        if (was_post) schedule_send();
+    }
+    void do_read()
+    {
+        sock_.async_read_some(decoder_.prepare(), strand_.wrap(boost::bind(&self_type::on_read, this->shared_from_this(), _1, _2)));
+    }
+    void do_write(const frame_ptr &msg)
+    {
+        if (!started_) return;
+        if (writing_) pending_.push_back(msg);
+        else write_frame(msg);
+    }
+    void write_frame(const frame_ptr &msg)
+    {
+        writing_ = msg;
+        async_write(sock_, buffer(*writing_), strand_.wrap(boost::bind(&self_type::on_write, this->shared_from_this(), _1, _2)));
+    }
+
+private:
+    typename Transport::socket_type sock_;
+    io_service::strand strand_;
+    steady_timer timer_;
+    bool started_;
+    std::string username_;
+    std::string room_;
+    std::chrono::nanoseconds interval_;
+    load_clock::time_point next_send_;
+    std::string text_;
+    boost::uint32_t sequence_;
+    boost::atomic<unsigned long long> sent_;
+    frame_decoder decoder_;
+    frame_ptr writing_;
+    std::vector<frame_ptr> pending_;
+};
+
+// room of every connection; with skew > 0 room k is picked with weight 1 / (k + 1)^skew
+std::vector<std::string> assign_rooms(const load_config &config)
+{
+    std::vector<std::string> rooms;
+    if (config.rooms == 0) {
+        rooms.assign(config.conns, default_room);
+        return rooms;
+    }
+    std::vector<double> weights;
+    for (unsigned k = 0; k < config.rooms; ++k) weights.push_back(1.0 / std::pow(k + 1.0, config.skew));
+    std::mt19937 gen(config.seed);
+    std::discrete_distribution<unsigned> pick(weights.begin(), weights.end());
+    for (unsigned i = 0; i < config.conns; ++i) rooms.push_back("room" + std::to_string(pick(gen)));
+    return rooms;
+}
+
+void worker_thread()
+{
+    service.run();
+}
+
+template <class Done>
+void wait_until(Done done, unsigned timeout_ms)
+{
+    for (unsigned waited = 0; !done() && waited < timeout_ms; waited += 10)
+        boost::this_thread::sleep(boost::posix_time::millisec(10));
+}
+
+template <class Transport>
+int run_load(const load_config &config, const typename Transport::endpoint_type &ep)
+{
+    typedef talk_to_svr<Transport> client_type;
+    sending = config.duration > 0;
+    std::vector<std::string> rooms = assign_rooms(config);
+
+    io_service::work work(service);
+    boost::thread_group pool;
+    for (unsigned i = 0; i < config.threads; ++i)
+        pool.create_thread(worker_thread);
+
+    load_clock::time_point ramp_begin = load_clock::now();
+    std::vector<typename client_type::ptr> clients;
+    for (unsigned i = 0; i < config.conns; ++i) {
+        clients.push_back(client_type::start(ep, "load" + std::to_string(i), rooms[i], config));
+        if (config.ramp) std::this_thread::sleep_until(ramp_begin + std::chrono::microseconds(1000000LL * (i + 1) / config.ramp));
+    }
+    wait_until([&] { return ready + failed >= config.conns; }, 10000);
+    double ramp_seconds = std::chrono::duration<double>(load_clock::now() - ramp_begin).count();
+
+    window_begin = now_ns();
+    boost::this_thread::sleep(boost::posix_time::seconds(config.duration));
+    window_end = now_ns();
+    double window_seconds = (window_end - window_begin) / 1e9;
+
+    // every post reaches each member of its room, the sender included
+    std::map<std::string, unsigned long long> members;
+    for (auto it = clients.begin(), e = clients.end(); it != e; ++it) ++members[(*it)->room()];
+    unsigned long long sent = 0, expected = 0;
+    auto count_sent = [&] {
+        sent = expected = 0;
+        for (auto it = clients.begin(), e = clients.end(); it != e; ++it) {
+            sent += (*it)->sent();
+            expected += (*it)->sent() * members[(*it)->room()];
+        }
+    };
+    // let in-flight copies arrive (posts of a lagging connection that were
+    // scheduled inside the window may still be going out), then stop
+    unsigned long long seen = delivered.value();
+    for (unsigned idle = 0; count_sent(), (unsigned long long)delivered.value() < expected && idle < 10; ) {
+        boost::this_thread::sleep(boost::posix_time::millisec(100));
+        unsigned long long now = delivered.value();
+        idle = now == seen ? idle + 1 : 0;
+        seen = now;
+    }
+    sending = false;
+    boost::this_thread::sleep(boost::posix_time::seconds(config.hold));
+    stopping = true;
+    for (auto it = clients.begin(), e = clients.end(); it != e; ++it) (*it)->stop_public();
+
+    histogram::snapshot lat = latency.take();
+    unsigned long long received = delivered.value();
+    std::cout << "{\"config\": {\"conns\": " << config.conns << ", \"ramp\": " << config.ramp
+              << ", \"size\": " << config.size << ", \"rate\": " << config.rate
+              << ", \"rooms\": " << config.rooms << ", \"skew\": " << config.skew
+              << ", \"duration\": " << config.duration << ", \"threads\": " << config.threads << "},\n"
+              << " \"connections\": {\"ready\": " << ready << ", \"failed\": " << failed
+              << ", \"disconnected\": " << disconnected << ", \"ramp_seconds\": " << ramp_seconds
+              << ", \"connects_per_second\": " << (unsigned long long)(ready / ramp_seconds) << "},\n"
+              << " \"window_seconds\": " << window_seconds << ",\n"
+              << " \"sent\": " << sent << ", \"expected\": " << expected << ", \"delivered\": " << received << ",\n"
+              << " \"send_rate\": " << (unsigned long long)(sent / window_seconds)
+              << ", \"delivery_rate\": " << (unsigned long long)(received / window_seconds) << ",\n"
+              << " \"latency_us\": {\"samples\": " << lat.count
+              << ", \"mean\": " << (lat.count ? lat.sum / lat.count : 0)
+              << ", \"p50\": " << lat.quantile(0.5) << ", \"p90\": " << lat.quantile(0.9)
+              << ", \"p99\": " << lat.quantile(0.99) << ", \"p999\": " << lat.quantile(0.999)
+              << ", \"max\": " << lat.quantile(1.0) << "}}\n";
+
+    service.stop();
+    pool.join_all();
+    return ready == config.conns && received >= expected ? 0 : 1;
+}
+
+int main(int argc, char const *argv[])
+{
+    load_config config;
+    if (!parse_config(argc, argv, config)) {
+        std::cerr << "usage: ./load_client [conns=N] [ramp=N] [size=N] [rate=N] [rooms=N] [skew=X] [duration=N] [threads=N] [port=N] [seed=N]"
+                     " [transport=tcp|unix:<path>|loopback] [server_threads=N] [hold=N]\n";
+        return 2;
+    }
+    if (config.transport.compare(0, 5, "unix:") == 0)
+        return run_load<unix_transport>(config, local::stream_protocol::endpoint(config.transport.substr(5)));
+    if (config.transport != "loopback")
+        return run_load<tcp_transport>(config, ip::tcp::endpoint(ip::address_v4::loopback(), config.port));
+
+    io_service server_service;
+    metrics_registry metrics;
+    chat_server<loopback_transport> server(server_service, metrics);
+    server.listen(loopback_endpoint());
+    boost::thread_group server_pool;
+    for (unsigned i = 0; i < config.server_threads; ++i)
+        server_pool.create_thread(boost::bind(&io_service::run, &server_service));
+    int result = run_load<loopback_transport>(config, loopback_endpoint());
+    server.stop();
+    server_service.stop();
+    server_pool.join_all();
+    return result;
+}
@@ -0,0 +1,277 @@
+#ifndef LOGGER_HPP
+#define LOGGER_HPP
+
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Asynchronous logger for the server hot path.
+//
+//   LOG_INFO("client {} joined room '{}'", id, room);
+//
+// The calling thread only copies the format pointer (it must be a string
+// literal), a timestamp and the raw arguments into a record of its own
+// single-producer ring buffer; no lock, no formatting, no syscall. A background
+// thread drains every ring, formats the records and writes them out. When a
+// ring is full the record is dropped and counted instead of blocking.
+//
+// Levels below LOG_LEVEL (compile with -DLOG_LEVEL=0 for everything) are
+// removed at compile time, arguments included.
+
+enum log_level { log_trace = 0, log_debug = 1, log_info = 2, log_warn = 3, log_error = 4 };
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL 2
+#endif
+
+#define LOG_AT(level, ...) do { if ((level) >= LOG_LEVEL) async_logger::instance().write((level), __VA_ARGS__); } while (0)
+#define LOG_TRACE(...) LOG_AT(log_trace, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(log_debug, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(log_info, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(log_warn, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(log_error, __VA_ARGS__)
+
+// one log call, arguments captured in binary form
+class log_record
+{
+public:
+    enum { max_args = 8, text_size = 160 };
+
+    void reset(log_level level, const char *format)
+    {
+        level_ = level;
+        format_ = format;
+        time_ = std::chrono::system_clock::now();
+        nargs_ = 0;
+        text_used_ = 0;
+    }
+    void add(bool v) { add_integer(v ? 1 : 0, true); }
+    void add(char v) { add_text(&v, 1); }
+    template <class T>
+    typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value>::type add(T v) { add_integer(v, true); }
+    template <class T>
+    typename std::enable_if<std::is_integral<T>::value && !std::is_signed<T>::value>::type add(T v) { add_integer(v, false); }
+    void add(double v)
+    {
+        if (nargs_ == max_args) return;
+        args_[nargs_].kind = arg_double;
+        args_[nargs_++].d = v;
+    }
+    void add(const char *s) { add_text(s, s ? strlen(s) : 0); }
+    void add(const std::string &s) { add_text(s.data(), s.size()); }
+
+    // replaces every "{}" in the format with the next argument
+    void format(std::string &out) const
+    {
+        std::time_t t = std::chrono::system_clock::to_time_t(time_);
+        long micros = long(std::chrono::duration_cast<std::chrono::microseconds>(time_.time_since_epoch()).count() % 1000000);
+        std::tm tm;
+        localtime_r(&t, &tm);
+        static const char *names[] = { "trace", "debug", "info", "warn", "error" };
+        char prefix[64];
+        snprintf(prefix, sizeof(prefix), "%02d:%02d:%02d.%06ld [%s] ", tm.tm_hour, tm.tm_min, tm.tm_sec, micros, names[level_]);
+        out += prefix;
+        unsigned next = 0;
+        for (const char *p = format_; *p; ++p) {
+            if (p[0] == '{' && p[1] == '}' && next < nargs_) {
+                append_arg(out, args_[next++]);
+                ++p;
+            } else {
+                out += *p;
+            }
+        }
+        out += '\n';
+    }
+
+private:
+    enum arg_kind { arg_signed, arg_unsigned, arg_double, arg_text };
+    struct text_ref
+    {
+        unsigned short offset;
+        unsigned short length;
+    };
+    struct arg
+    {
+        arg_kind kind;
+        union
+        {
+            long long i;
+            unsigned long long u;
+            double d;
+            text_ref text;
+        };
+    };
+
+    void add_integer(long long v, bool is_signed)
+    {
+        if (nargs_ == max_args) return;
+        args_[nargs_].kind = is_signed ? arg_signed : arg_unsigned;
+        args_[nargs_++].i = v;
+    }
+    // strings are copied (and truncated) into the record, they may not outlive the call
+    void add_text(const char *s, size_t length)
+    {
+        if (nargs_ == max_args) return;
+        length = std::min<size_t>(length, text_size - text_used_);
+        memcpy(text_ + text_used_, s, length);
+        args_[nargs_].kind = arg_text;
+        args_[nargs_].text.offset = (unsigned short)text_used_;
+        args_[nargs_++].text.length = (unsigned short)length;
+        text_used_ += length;
+    }
+    void append_arg(std::string &out, const arg &a) const
+    {
+        char buf[32];
+        switch (a.kind) {
+        case arg_signed: snprintf(buf, sizeof(buf), "%lld", a.i); out += buf; break;
+        case arg_unsigned: snprintf(buf, sizeof(buf), "%llu", a.u); out += buf; break;
+        case arg_double: snprintf(buf, sizeof(buf), "%g", a.d); out += buf; break;
+        case arg_text: out.append(text_ + a.text.offset, a.text.length); break;
+        }
+    }
+
+private:
+    log_level level_;
+    const char *format_;
+    std::chrono::system_clock::time_point time_;
+    unsigned nargs_;
+    size_t text_used_;
+    arg args_[max_args];
+    char text_[text_size];
+};
+
+inline void capture_args(log_record &) {}
+template <class T, class... Args>
+inline void capture_args(log_record &r, const T &v, const Args&... args)
+{
+    r.add(v);
+    capture_args(r, args...);
+}
+
+// single producer (the owning thread), single consumer (the drain thread)
+class log_ring : boost::noncopyable
+{
+public:
+    enum { capacity = 4096 };
+
+    log_ring() : head_(0), tail_(0) {}
+
+    log_record* claim()
+    {
+        size_t head = head_.load(boost::memory_order_relaxed);
+        if (head - tail_.load(boost::memory_order_acquire) == capacity) return 0;
+        return &records_[head % capacity];
+    }
+    void publish() { head_.store(head_.load(boost::memory_order_relaxed) + 1, boost::memory_order_release); }
+    // formats everything published so far into out
+    size_t drain(std::string &out)
+    {
+        size_t tail = tail_.load(boost::memory_order_relaxed);
+        size_t head = head_.load(boost::memory_order_acquire);
+        for (size_t i = tail; i != head; ++i)
+            records_[i % capacity].format(out);
+        tail_.store(head, boost::memory_order_release);
+        return head - tail;
+    }
+
+private:
+    log_record records_[capacity];
+    boost::atomic<size_t> head_;
+    boost::atomic<size_t> tail_;
+};
+
+class async_logger : boost::noncopyable
+{
+public:
+    static async_logger& instance()
+    {
+        static async_logger logger;
+        return logger;
+    }
+    template <class... Args>
+    void write(log_level level, const char *format, const Args&... args)
+    {
+        log_ring &r = ring();
+        log_record *rec = r.claim();
+        if (!rec) {
+            dropped_.fetch_add(1, boost::memory_order_relaxed);
+            return;
+        }
+        rec->reset(level, format);
+        capture_args(*rec, args...);
+        r.publish();
+    }
+    unsigned long long dropped() const { return dropped_.load(boost::memory_order_relaxed); }
+    ~async_logger()
+    {
+        stop_ = true;
+        thread_.join();
+        drain_all();
+    }
+
+private:
+    async_logger() : out_(stdout), stop_(false), dropped_(0), reported_dropped_(0)
+    {
+        thread_ = boost::thread([this] { run(); });
+    }
+    // each thread gets its own ring the first time it logs; io threads live
+    // as long as the process, so rings are never released
+    log_ring& ring()
+    {
+        static thread_local log_ring *r = 0;
+        if (!r) {
+            r = new log_ring;
+            boost::mutex::scoped_lock lk(rings_mutex_);
+            rings_.push_back(r);
+        }
+        return *r;
+    }
+    void run()
+    {
+        while (!stop_) {
+            if (drain_all() == 0) boost::this_thread::sleep(boost::posix_time::millisec(2));
+        }
+    }
+    size_t drain_all()
+    {
+        std::vector<log_ring*> rings;
+        {
+            boost::mutex::scoped_lock lk(rings_mutex_);
+            rings = rings_;
+        }
+        size_t n = 0;
+        for (std::vector<log_ring*>::iterator it = rings.begin(), e = rings.end(); it != e; ++it)
+            n += (*it)->drain(buffer_);
+        unsigned long long dropped = dropped_.load(boost::memory_order_relaxed);
+        if (dropped != reported_dropped_) {
+            buffer_ += "[logger] " + std::to_string(dropped - reported_dropped_) + " records dropped\n";
+            reported_dropped_ = dropped;
+        }
+        if (!buffer_.empty()) {
+            fwrite(buffer_.data(), 1, buffer_.size(), out_);
+            fflush(out_);
+            buffer_.clear();
+        }
+        return n;
+    }
+
+private:
+    FILE *out_;
+    boost::mutex rings_mutex_;
+    std::vector<log_ring*> rings_;
+    boost::thread thread_;
+    boost::atomic<bool> stop_;
+    boost::atomic<unsigned long long> dropped_;
+    unsigned long long reported_dropped_;
+    std::string buffer_;
+};
+
+#endif // LOGGER_HPP
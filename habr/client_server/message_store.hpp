@@ -0,0 +1,116 @@
+#ifndef MESSAGE_STORE_HPP
+#define MESSAGE_STORE_HPP
+
+#include <boost/noncopyable.hpp>
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <string>
+#include <vector>
+
+// The messages a client shows, oldest first. Text is copied into chunks of
+// `chunk_size` bytes that are filled front to back and never move, so a
+// message is a small record pointing into its chunk and append() costs the
+// copy of the message, however long the history is. Only the newest
+// `retention` messages are kept: the oldest records are dropped as new ones
+// come, and a chunk goes (to be reused) once none of its messages is left.
+//
+// Messages are numbered from 0 in the order they were appended; a dropped
+// message keeps its number, so first() grows as the window moves on.
+class message_store : boost::noncopyable
+{
+public:
+    struct message
+    {
+        const char *sender;
+        size_t sender_length;
+        const char *text;
+        size_t text_length;
+        std::time_t time;
+    };
+
+    explicit message_store(size_t retention = 100000, size_t chunk_size = 64 * 1024)
+        : retention_(std::max<size_t>(retention, 1)), chunk_size_(chunk_size), first_(0) {}
+    ~message_store()
+    {
+        for (std::deque<chunk>::iterator it = chunks_.begin(); it != chunks_.end(); ++it) delete[] it->data;
+        for (std::vector<chunk>::iterator it = spare_.begin(); it != spare_.end(); ++it) delete[] it->data;
+    }
+
+    void append(const std::string &sender, const std::string &text, std::time_t time)
+    {
+        size_t length = sender.size() + text.size();
+        if (chunks_.empty() || chunks_.back().capacity - chunks_.back().used < length) add_chunk(length);
+        chunk &c = chunks_.back();
+        char *at = c.data + c.used;
+        memcpy(at, sender.data(), sender.size());
+        memcpy(at + sender.size(), text.data(), text.size());
+        c.used += length;
+        c.last = end();
+        message m = { at, sender.size(), at + sender.size(), text.size(), time };
+        messages_.push_back(m);
+        if (messages_.size() > retention_) drop_oldest(messages_.size() - retention_);
+    }
+    // keeps at most the newest `retention` messages from now on
+    void set_retention(size_t retention)
+    {
+        retention_ = std::max<size_t>(retention, 1);
+        if (messages_.size() > retention_) drop_oldest(messages_.size() - retention_);
+    }
+
+    // numbers of the oldest message kept and one past the newest
+    unsigned long long first() const { return first_; }
+    unsigned long long end() const { return first_ + messages_.size(); }
+    size_t size() const { return messages_.size(); }
+    bool empty() const { return messages_.empty(); }
+    // n in [first(), end())
+    const message& operator[](unsigned long long n) const { return messages_[n - first_]; }
+
+private:
+    struct chunk
+    {
+        char *data;
+        size_t capacity;
+        size_t used;
+        // number of the newest message in the chunk
+        unsigned long long last;
+    };
+
+    void add_chunk(size_t length)
+    {
+        chunk c = { 0, 0, 0, 0 };
+        if (length <= chunk_size_ && !spare_.empty()) {
+            c = spare_.back();
+            spare_.pop_back();
+        } else {
+            c.capacity = std::max(length, chunk_size_);
+            c.data = new char[c.capacity];
+        }
+        c.used = 0;
+        chunks_.push_back(c);
+    }
+    void drop_oldest(size_t count)
+    {
+        messages_.erase(messages_.begin(), messages_.begin() + count);
+        first_ += count;
+        // the current chunk stays even when it has no message left
+        while (chunks_.size() > 1 && chunks_.front().last < first_) {
+            chunk c = chunks_.front();
+            chunks_.pop_front();
+            // one spare is enough to cycle through while the window is full
+            if (c.capacity == chunk_size_ && spare_.empty()) spare_.push_back(c);
+            else delete[] c.data;
+        }
+    }
+
+private:
+    size_t retention_;
+    size_t chunk_size_;
+    std::deque<message> messages_;
+    std::deque<chunk> chunks_;
+    std::vector<chunk> spare_;
+    unsigned long long first_;
+};
+
+#endif // MESSAGE_STORE_HPP
@@ -0,0 +1,203 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <boost/atomic.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <string>
+#include <vector>
+
+// Runtime metrics: counters, gauges and latency histograms, rendered in the
+// Prometheus text format. Every metric is split into per-thread shards on
+// their own cache lines, so io threads update them with one relaxed atomic add
+// and never contend; readers sum the shards when a snapshot is taken.
+
+enum { metric_shards = 16 };
+
+// each thread writes to its own shard (threads beyond metric_shards share)
+inline unsigned metric_shard()
+{
+    static boost::atomic<unsigned> next(0);
+    static thread_local unsigned shard = next.fetch_add(1, boost::memory_order_relaxed) % metric_shards;
+    return shard;
+}
+
+// monotonic (counter) or up/down (gauge) value
+class metric_value : boost::noncopyable
+{
+public:
+    metric_value()
+    {
+        for (unsigned i = 0; i < metric_shards; ++i) shards_[i].value = 0;
+    }
+    void add(long long v) { shards_[metric_shard()].value.fetch_add(v, boost::memory_order_relaxed); }
+    void inc() { add(1); }
+    void dec() { add(-1); }
+    long long value() const
+    {
+        long long sum = 0;
+        for (unsigned i = 0; i < metric_shards; ++i) sum += shards_[i].value.load(boost::memory_order_relaxed);
+        return sum;
+    }
+
+private:
+    struct alignas(64) shard
+    {
+        boost::atomic<long long> value;
+    };
+    shard shards_[metric_shards];
+};
+typedef metric_value counter;
+typedef metric_value gauge;
+
+// HDR-style log-linear histogram of non-negative integers (microseconds, sizes):
+// values below 8 have exact buckets, above that every power of two is split
+// into 8 sub-buckets, which keeps the relative error under 12.5% at any scale.
+class histogram : boost::noncopyable
+{
+public:
+    enum { sub_bits = 3, sub_count = 1 << sub_bits, bucket_count = sub_count + (64 - sub_bits) * sub_count };
+
+    histogram()
+    {
+        for (unsigned i = 0; i < metric_shards; ++i) {
+            shards_[i].sum = 0;
+            for (unsigned b = 0; b < bucket_count; ++b) shards_[i].buckets[b] = 0;
+        }
+    }
+    void record(unsigned long long v)
+    {
+        shard &s = shards_[metric_shard()];
+        s.buckets[bucket_of(v)].fetch_add(1, boost::memory_order_relaxed);
+        s.sum.fetch_add(v, boost::memory_order_relaxed);
+    }
+
+    struct snapshot
+    {
+        std::vector<unsigned long long> buckets;
+        unsigned long long count;
+        unsigned long long sum;
+
+        // upper bound of the bucket holding the q-th quantile (q in [0, 1])
+        unsigned long long quantile(double q) const
+        {
+            if (count == 0) return 0;
+            unsigned long long rank = (unsigned long long)(q * (count - 1)) + 1, seen = 0;
+            for (size_t b = 0; b < buckets.size(); ++b) {
+                seen += buckets[b];
+                if (seen >= rank) return histogram::upper_bound(b);
+            }
+            return histogram::upper_bound(buckets.size() - 1);
+        }
+    };
+    snapshot take() const
+    {
+        snapshot snap;
+        snap.buckets.assign(bucket_count, 0);
+        snap.count = snap.sum = 0;
+        for (unsigned i = 0; i < metric_shards; ++i) {
+            snap.sum += shards_[i].sum.load(boost::memory_order_relaxed);
+            for (unsigned b = 0; b < bucket_count; ++b) {
+                unsigned long long n = shards_[i].buckets[b].load(boost::memory_order_relaxed);
+                snap.buckets[b] += n;
+                snap.count += n;
+            }
+        }
+        return snap;
+    }
+
+    static unsigned bucket_of(unsigned long long v)
+    {
+        if (v < sub_count) return unsigned(v);
+        unsigned e = 63 - __builtin_clzll(v);
+        return sub_count + (e - sub_bits) * sub_count + unsigned((v >> (e - sub_bits)) & (sub_count - 1));
+    }
+    // largest value that falls into bucket b
+    static unsigned long long upper_bound(size_t b)
+    {
+        if (b < sub_count) return b;
+        unsigned e = unsigned((b - sub_count) / sub_count) + sub_bits;
+        unsigned long long s = (b - sub_count) % sub_count;
+        return ((sub_count + s + 1) << (e - sub_bits)) - 1;
+    }
+
+private:
+    struct alignas(64) shard
+    {
+        boost::atomic<unsigned long long> buckets[bucket_count];
+        boost::atomic<unsigned long long> sum;
+    };
+    shard shards_[metric_shards];
+};
+
+// Named metrics of one process. Metrics are registered once at startup and
+// live as long as the registry; the returned references are what hot paths keep.
+class metrics_registry : boost::noncopyable
+{
+public:
+    counter& add_counter(const std::string &name, const std::string &help) { return *add<counter>(name, help, "counter", counters_); }
+    gauge& add_gauge(const std::string &name, const std::string &help) { return *add<gauge>(name, help, "gauge", gauges_); }
+    histogram& add_histogram(const std::string &name, const std::string &help) { return *add<histogram>(name, help, "histogram", histograms_); }
+
+    // Prometheus text exposition format (version 0.0.4)
+    std::string render() const
+    {
+        boost::mutex::scoped_lock lk(mutex_);
+        std::string out;
+        for (size_t i = 0; i < entries_.size(); ++i) {
+            const entry &e = entries_[i];
+            out += "# HELP " + e.name + " " + e.help + "\n";
+            out += "# TYPE " + e.name + " " + e.type + "\n";
+            if (e.type == "histogram") render_histogram(out, e.name, histograms_[e.index]->take());
+            else if (e.type == "counter") out += e.name + " " + std::to_string(counters_[e.index]->value()) + "\n";
+            else out += e.name + " " + std::to_string(gauges_[e.index]->value()) + "\n";
+        }
+        return out;
+    }
+
+private:
+    struct entry
+    {
+        std::string name;
+        std::string help;
+        std::string type;
+        size_t index;
+    };
+    template <class Metric>
+    boost::shared_ptr<Metric> add(const std::string &name, const std::string &help, const char *type, std::vector<boost::shared_ptr<Metric> > &metrics)
+    {
+        boost::mutex::scoped_lock lk(mutex_);
+        entry e = { name, help, type, metrics.size() };
+        entries_.push_back(e);
+        metrics.push_back(boost::make_shared<Metric>());
+        return metrics.back();
+    }
+    // cumulative buckets at every power of two, up to the largest recorded value
+    static void render_histogram(std::string &out, const std::string &name, const histogram::snapshot &snap)
+    {
+        size_t last = 0;
+        for (size_t b = 0; b < snap.buckets.size(); ++b)
+            if (snap.buckets[b]) last = b;
+        unsigned long long cumulative = 0;
+        for (size_t b = 0; b <= last; ++b) {
+            cumulative += snap.buckets[b];
+            unsigned long long le = histogram::upper_bound(b);
+            if (b == last || ((le + 1) & le) == 0)
+                out += name + "_bucket{le=\"" + std::to_string(le) + "\"} " + std::to_string(cumulative) + "\n";
+        }
+        out += name + "_bucket{le=\"+Inf\"} " + std::to_string(snap.count) + "\n";
+        out += name + "_sum " + std::to_string(snap.sum) + "\n";
+        out += name + "_count " + std::to_string(snap.count) + "\n";
+    }
+
+private:
+    mutable boost::mutex mutex_;
+    std::vector<entry> entries_;
+    std::vector<boost::shared_ptr<counter> > counters_;
+    std::vector<boost::shared_ptr<gauge> > gauges_;
+    std::vector<boost::shared_ptr<histogram> > histograms_;
+};
+
+#endif // METRICS_HPP
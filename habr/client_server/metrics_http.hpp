@@ -0,0 +1,76 @@
+#ifndef METRICS_HTTP_HPP
+#define METRICS_HTTP_HPP
+
+#include <boost/asio.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/noncopyable.hpp>
+#include "metrics.hpp"
+
+// Minimal admin endpoint: any HTTP request to 127.0.0.1:<port> is answered with
+// the registry rendered in the Prometheus text format, then the connection is
+// closed. It is only bound to loopback; scrape it locally or through a proxy.
+class metrics_endpoint : boost::noncopyable
+{
+public:
+    metrics_endpoint(boost::asio::io_service &service, const metrics_registry &registry, unsigned short port)
+        : service_(service), acceptor_(service, boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), port)), registry_(registry)
+    {
+        accept();
+    }
+
+private:
+    class request : public boost::enable_shared_from_this<request>, boost::noncopyable
+    {
+    public:
+        typedef boost::system::error_code error_code;
+        request(boost::asio::io_service &service, const metrics_registry &registry) : sock_(service), registry_(registry) {}
+        boost::asio::ip::tcp::socket& sock() { return sock_; }
+        void start()
+        {
+            boost::asio::async_read_until(sock_, request_, "\r\n\r\n",
+                boost::bind(&request::on_read, shared_from_this(), boost::asio::placeholders::error));
+        }
+
+    private:
+        void on_read(const error_code &err)
+        {
+            if (err) return;
+            std::string body = registry_.render();
+            response_ = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+                + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+            boost::asio::async_write(sock_, boost::asio::buffer(response_),
+                boost::bind(&request::on_write, shared_from_this(), boost::asio::placeholders::error));
+        }
+        void on_write(const error_code &err)
+        {
+            error_code ignored;
+            sock_.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+            sock_.close(ignored);
+        }
+
+    private:
+        boost::asio::ip::tcp::socket sock_;
+        const metrics_registry &registry_;
+        boost::asio::streambuf request_;
+        std::string response_;
+    };
+
+    void accept()
+    {
+        boost::shared_ptr<request> r(new request(service_, registry_));
+        acceptor_.async_accept(r->sock(), boost::bind(&metrics_endpoint::on_accept, this, r, boost::asio::placeholders::error));
+    }
+    void on_accept(boost::shared_ptr<request> r, const boost::system::error_code &err)
+    {
+        if (!err) r->start();
+        accept();
+    }
+
+private:
+    boost::asio::io_service &service_;
+    boost::asio::ip::tcp::acceptor acceptor_;
+    const metrics_registry &registry_;
+};
+
+#endif // METRICS_HTTP_HPP
@@ -0,0 +1,251 @@
+#ifndef POOL_HPP
+#define POOL_HPP
+
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Memory for long-lived, numerous objects: sessions come from per-type slabs
+// instead of one malloc each, and I/O buffers are lent out by size class for
+// as long as a read needs them, so idle connections own no buffer at all.
+
+// Fixed-size slots carved out of slabs of `per_slab` objects. Freed slots go
+// on a free list and are reused; slabs are never given back to the system.
+template <size_t Size, size_t per_slab = 256>
+class slab_pool : boost::noncopyable
+{
+public:
+    // never destroyed: objects may still be freed by the destructors of
+    // other statics (a global io_service dropping its handlers) at exit
+    static slab_pool& instance()
+    {
+        static slab_pool *pool = new slab_pool;
+        return *pool;
+    }
+    void* allocate()
+    {
+        boost::mutex::scoped_lock lk(mutex_);
+        if (!free_) grow();
+        slot *s = free_;
+        free_ = s->next;
+        return s;
+    }
+    void deallocate(void *p)
+    {
+        boost::mutex::scoped_lock lk(mutex_);
+        slot *s = static_cast<slot*>(p);
+        s->next = free_;
+        free_ = s;
+    }
+
+private:
+    union slot
+    {
+        slot *next;
+        char storage[Size];
+        long double align;
+    };
+    slab_pool() : free_(0) {}
+    void grow()
+    {
+        slot *slab = static_cast<slot*>(::operator new(sizeof(slot) * per_slab));
+        for (size_t i = 0; i < per_slab; ++i) {
+            slab[i].next = free_;
+            free_ = &slab[i];
+        }
+    }
+
+private:
+    boost::mutex mutex_;
+    slot *free_;
+};
+
+// Base for objects held by boost::intrusive_ptr and allocated from a slab:
+// the count lives in the object (no separate control block) and the object
+// itself in a slot of slab_pool<sizeof(Derived)>.
+template <class Derived>
+class pooled_object : boost::noncopyable
+{
+public:
+    static void* operator new(size_t size)
+    {
+        return slab_pool<sizeof(Derived)>::instance().allocate();
+    }
+    static void operator delete(void *p)
+    {
+        slab_pool<sizeof(Derived)>::instance().deallocate(p);
+    }
+
+    friend void intrusive_ptr_add_ref(const Derived *p)
+    {
+        p->refs_.fetch_add(1, boost::memory_order_relaxed);
+    }
+    friend void intrusive_ptr_release(const Derived *p)
+    {
+        if (p->refs_.fetch_sub(1, boost::memory_order_release) == 1) {
+            boost::atomic_thread_fence(boost::memory_order_acquire);
+            delete p;
+        }
+    }
+
+protected:
+    pooled_object() : refs_(0) {}
+
+private:
+    mutable boost::atomic<unsigned> refs_;
+};
+
+// Size-classed byte buffers, 1 KB to 256 KB in powers of four. A few freed
+// buffers of each class are kept for reuse, the rest go back to malloc.
+class buffer_pool : boost::noncopyable
+{
+public:
+    enum { min_size = 1024, classes = 5, max_cached = 256 };
+
+    // never destroyed, like slab_pool::instance()
+    static buffer_pool& instance()
+    {
+        static buffer_pool *pool = new buffer_pool;
+        return *pool;
+    }
+    // a buffer of at least `size` bytes; its real size is returned in capacity
+    char* allocate(size_t size, size_t &capacity)
+    {
+        size_t c = size_class(size);
+        if (c == classes) {
+            capacity = size;
+            return static_cast<char*>(::operator new(size));
+        }
+        capacity = class_size(c);
+        {
+            boost::mutex::scoped_lock lk(mutex_);
+            if (!free_[c].empty()) {
+                char *p = free_[c].back();
+                free_[c].pop_back();
+                return p;
+            }
+        }
+        return static_cast<char*>(::operator new(capacity));
+    }
+    void deallocate(char *p, size_t capacity)
+    {
+        size_t c = size_class(capacity);
+        if (c < classes) {
+            boost::mutex::scoped_lock lk(mutex_);
+            if (free_[c].size() < max_cached) {
+                free_[c].push_back(p);
+                return;
+            }
+        }
+        ::operator delete(p);
+    }
+
+    static size_t class_size(size_t c) { return size_t(min_size) << (2 * c); }
+    // smallest class holding `size` bytes, `classes` when none does
+    static size_t size_class(size_t size)
+    {
+        size_t c = 0;
+        while (c < classes && class_size(c) < size) ++c;
+        return c;
+    }
+
+private:
+    buffer_pool() {}
+
+private:
+    boost::mutex mutex_;
+    std::vector<char*> free_[classes];
+};
+
+// Memory for the asynchronous operations of one session. asio allocates an
+// operation's state through its handler's associated allocator (see
+// alloc_handler), and a session has only a few operations in flight, so each
+// takes one of `Slots` blocks of `Size` bytes and gives it back when it
+// completes. Blocks may be taken and returned on different threads; larger
+// requests, or more at once than there are slots, go to operator new.
+template <size_t Size, size_t Slots>
+class handler_memory : boost::noncopyable
+{
+public:
+    handler_memory()
+    {
+        for (size_t i = 0; i < Slots; ++i) in_use_[i] = false;
+    }
+    void* allocate(size_t size)
+    {
+        if (size <= Size)
+            for (size_t i = 0; i < Slots; ++i)
+                if (!in_use_[i].exchange(true, boost::memory_order_acquire)) return blocks_[i].bytes;
+        return ::operator new(size);
+    }
+    void deallocate(void *p)
+    {
+        for (size_t i = 0; i < Slots; ++i)
+            if (p == blocks_[i].bytes) {
+                in_use_[i].store(false, boost::memory_order_release);
+                return;
+            }
+        ::operator delete(p);
+    }
+
+private:
+    union block
+    {
+        char bytes[Size];
+        std::max_align_t align;
+    };
+    block blocks_[Slots];
+    boost::atomic<bool> in_use_[Slots];
+};
+
+template <class T, class Memory>
+class handler_allocator
+{
+public:
+    typedef T value_type;
+
+    explicit handler_allocator(Memory &memory) : memory_(&memory) {}
+    template <class U>
+    handler_allocator(const handler_allocator<U, Memory> &other) : memory_(other.memory_) {}
+    T* allocate(size_t n) { return static_cast<T*>(memory_->allocate(sizeof(T) * n)); }
+    void deallocate(T *p, size_t) { memory_->deallocate(p); }
+    template <class U>
+    bool operator==(const handler_allocator<U, Memory> &other) const { return memory_ == other.memory_; }
+    template <class U>
+    bool operator!=(const handler_allocator<U, Memory> &other) const { return memory_ != other.memory_; }
+
+private:
+    template <class U, class M> friend class handler_allocator;
+    Memory *memory_;
+};
+
+// A completion handler whose operations are allocated from `memory`
+template <class Memory, class Handler>
+class alloc_handler
+{
+public:
+    typedef handler_allocator<char, Memory> allocator_type;
+
+    alloc_handler(Memory &memory, const Handler &handler) : memory_(&memory), handler_(handler) {}
+    allocator_type get_allocator() const noexcept { return allocator_type(*memory_); }
+    template <class... Args>
+    void operator()(Args&&... args) { handler_(std::forward<Args>(args)...); }
+
+private:
+    Memory *memory_;
+    Handler handler_;
+};
+
+template <class Memory, class Handler>
+alloc_handler<Memory, typename std::decay<Handler>::type> make_alloc_handler(Memory &memory, Handler &&handler)
+{
+    return alloc_handler<Memory, typename std::decay<Handler>::type>(memory, std::forward<Handler>(handler));
+}
+
+#endif // POOL_HPP
@@ -0,0 +1,85 @@
+#ifndef PRESENCE_HPP
+#define PRESENCE_HPP
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <deque>
+#include <string>
+#include <unordered_map>
+
+// Versioned set of logged-in usernames.
+// Every join or leave bumps the version and is remembered in a bounded change
+// log, so a client that knows version V is sent only what happened after V.
+// Clients too far behind (or new ones, V == 0) get the full member list.
+class presence : boost::noncopyable
+{
+public:
+    typedef unsigned long long version_type;
+
+    explicit presence(size_t max_changes = 4096) : version_(0), max_changes_(max_changes) {}
+
+    // the same name may be logged in more than once; it is present while any of them is
+    void join(const std::string &username)
+    {
+        boost::mutex::scoped_lock lk(mutex_);
+        if (members_[username]++ == 0) record(username, true);
+    }
+    void leave(const std::string &username)
+    {
+        boost::mutex::scoped_lock lk(mutex_);
+        std::unordered_map<std::string, unsigned>::iterator it = members_.find(username);
+        if (it == members_.end()) return;
+        if (--it->second == 0) {
+            members_.erase(it);
+            record(username, false);
+        }
+    }
+    version_type version() const
+    {
+        boost::mutex::scoped_lock lk(mutex_);
+        return version_;
+    }
+    // "clients <version> name name ...\n"
+    // or "clients_delta <version> +joined -left ...\n" when `since` is recent enough;
+    // `version` is set to the version the answer brings the client to
+    std::string changes_since(version_type since, version_type &version) const
+    {
+        boost::mutex::scoped_lock lk(mutex_);
+        version = version_;
+        std::string msg;
+        if (since == 0 || since > version_ || changes_.empty() || since + 1 < changes_.front().version) {
+            msg = "clients " + std::to_string(version_);
+            for (std::unordered_map<std::string, unsigned>::const_iterator b = members_.begin(), e = members_.end(); b != e; ++b)
+                msg += " " + b->first;
+        } else {
+            msg = "clients_delta " + std::to_string(version_);
+            // versions in the log are consecutive, so the first unseen change is found directly
+            for (std::deque<change>::const_iterator b = changes_.begin() + (since + 1 - changes_.front().version), e = changes_.end(); b != e; ++b)
+                msg += (b->joined ? " +" : " -") + b->username;
+        }
+        return msg + "\n";
+    }
+
+private:
+    struct change
+    {
+        version_type version;
+        std::string username;
+        bool joined;
+    };
+    void record(const std::string &username, bool joined)
+    {
+        change c = { ++version_, username, joined };
+        changes_.push_back(c);
+        if (changes_.size() > max_changes_) changes_.pop_front();
+    }
+
+private:
+    mutable boost::mutex mutex_;
+    version_type version_;
+    size_t max_changes_;
+    std::unordered_map<std::string, unsigned> members_;
+    std::deque<change> changes_;
+};
+
+#endif // PRESENCE_HPP
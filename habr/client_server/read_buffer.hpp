@@ -0,0 +1,76 @@
+#ifndef READ_BUFFER_HPP
+#define READ_BUFFER_HPP
+
+#include <boost/asio/buffer.hpp>
+#include <boost/noncopyable.hpp>
+#include <algorithm>
+#include <cstring>
+#include "pool.hpp"
+
+// Growable per-connection input buffer. Sockets read into prepare() as much as
+// fits, parsers look at data()/size() in place and consume() whole messages.
+// Unconsumed bytes (a partial message) are moved to the front only when the
+// tail runs short of room, so complete messages are never copied.
+// The storage is borrowed from buffer_pool on the first prepare() and can be
+// handed back with release() whenever no partial message is left.
+class read_buffer : boost::noncopyable
+{
+public:
+    explicit read_buffer(size_t initial_size = 1024)
+        : buf_(0), capacity_(0), initial_size_(initial_size), begin_(0), end_(0) {}
+    ~read_buffer()
+    {
+        if (buf_) buffer_pool::instance().deallocate(buf_, capacity_);
+    }
+
+    // free space after the buffered bytes, at least min_free long
+    boost::asio::mutable_buffers_1 prepare(size_t min_free = 1)
+    {
+        if (!buf_) buf_ = buffer_pool::instance().allocate(std::max(initial_size_, min_free), capacity_);
+        if (begin_ == end_) {
+            begin_ = end_ = 0;
+        } else if (begin_ > 0 && capacity_ - end_ < std::max(min_free, capacity_ / 4)) {
+            memmove(buf_, buf_ + begin_, end_ - begin_);
+            end_ -= begin_;
+            begin_ = 0;
+        }
+        if (capacity_ - end_ < min_free) grow(std::max(end_ + min_free, capacity_ * 2));
+        return boost::asio::buffer(buf_ + end_, capacity_ - end_);
+    }
+    void commit(size_t bytes) { end_ += bytes; }
+    const char* data() const { return buf_ + begin_; }
+    size_t size() const { return end_ - begin_; }
+    void consume(size_t bytes) { begin_ += bytes; }
+    // returns the storage to the pool if nothing is buffered; false if something is
+    bool release()
+    {
+        if (begin_ != end_) return false;
+        if (buf_) buffer_pool::instance().deallocate(buf_, capacity_);
+        buf_ = 0;
+        capacity_ = 0;
+        begin_ = end_ = 0;
+        return true;
+    }
+
+private:
+    void grow(size_t size)
+    {
+        size_t capacity;
+        char *bigger = buffer_pool::instance().allocate(size, capacity);
+        memcpy(bigger, buf_ + begin_, end_ - begin_);
+        buffer_pool::instance().deallocate(buf_, capacity_);
+        buf_ = bigger;
+        capacity_ = capacity;
+        end_ -= begin_;
+        begin_ = 0;
+    }
+
+private:
+    char *buf_;
+    size_t capacity_;
+    size_t initial_size_;
+    size_t begin_;
+    size_t end_;
+};
+
+#endif // READ_BUFFER_HPP
@@ -0,0 +1,198 @@
+#ifndef ROOMS_HPP
+#define ROOMS_HPP
+
+#include <boost/cstdint.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// What a session joining a room with join(..., since, ...) missed
+template <class Message>
+struct room_catch_up
+{
+    // the room's sequence when the session joined: later messages reach it live
+    boost::uint32_t sequence;
+    // the oldest sequence the room still remembers (sequence + 1 if none);
+    // what was missed before it has to come from the history log
+    boost::uint32_t oldest;
+    // the remembered messages after `since`, oldest first
+    std::vector<Message> recent;
+
+    room_catch_up() : sequence(0), oldest(1) {}
+};
+
+// A chat room: its subscribers are kept in one contiguous array of session
+// handles. Join and leave are O(1) (leave swaps the last member into the hole).
+// Broadcasts (publish()) walk that array under the room's lock, so they are
+// serialized within a room; different rooms broadcast concurrently.
+//
+// A room numbers its messages (publish()) and remembers the last `max_recent`
+// of them. Numbering, remembering and handing a message to every member
+// happen under one lock, as do joining and collecting what a resuming member
+// missed, so a member gets a room's messages in order, and one that resumes
+// gets each missed message exactly once: from the catch-up or live.
+//
+// Session needs: void send_message_public(const Message&)
+template <class Session, class SessionPtr = boost::shared_ptr<Session>, class Message = boost::shared_ptr<const std::string> >
+class room : boost::noncopyable
+{
+public:
+    typedef SessionPtr session_ptr;
+    typedef Message message_type;
+    typedef unsigned long long id_type;
+    typedef room_catch_up<Message> catch_up_type;
+    // for join(): the session wants nothing it missed
+    static const boost::uint32_t no_catch_up = 0xffffffff;
+
+    // `sequence` is the last one used by an earlier incarnation of the room
+    explicit room(const std::string &name, boost::uint32_t sequence = 0, size_t max_recent = 1024)
+        : name_(name), sequence_(sequence), first_sequence_(sequence), max_recent_(max_recent) {}
+
+    const std::string& name() const { return name_; }
+    bool join(id_type id, const session_ptr &session)
+    {
+        boost::mutex::scoped_lock lk(mutex_);
+        return add_member(id, session);
+    }
+    // joins and collects the remembered messages after `since`
+    bool join(id_type id, const session_ptr &session, boost::uint32_t since, catch_up_type &missed)
+    {
+        boost::mutex::scoped_lock lk(mutex_);
+        if (!add_member(id, session)) return false;
+        missed.sequence = sequence_;
+        missed.oldest = recent_.empty() ? sequence_ + 1 : recent_.front().first;
+        if (since == no_catch_up || since == sequence_) return true;
+        // ahead of the room: what the member saw was numbered by an earlier
+        // incarnation of it (a server restarted without a history log), so all
+        // of this one is new to it
+        if (since > sequence_) since = 0;
+        for (typename std::deque<std::pair<boost::uint32_t, Message> >::const_iterator it = recent_.begin(); it != recent_.end(); ++it)
+            if (it->first > since) missed.recent.push_back(it->second);
+        return true;
+    }
+    // numbers a message, `encode(sequence)` makes it, and hands it to every member;
+    // returns the number of members it went to
+    template <class Encode>
+    size_t publish(const Encode &encode)
+    {
+        boost::mutex::scoped_lock lk(mutex_);
+        Message msg = encode(++sequence_);
+        recent_.push_back(std::make_pair(sequence_, msg));
+        if (recent_.size() > max_recent_) recent_.pop_front();
+        for (typename std::vector<session_ptr>::const_iterator it = members_.begin(), e = members_.end(); it != e; ++it)
+            (*it)->send_message_public(msg);
+        return members_.size();
+    }
+    bool leave(id_type id)
+    {
+        boost::mutex::scoped_lock lk(mutex_);
+        typename std::unordered_map<id_type, size_t>::iterator it = index_.find(id);
+        if (it == index_.end()) return false;
+        size_t pos = it->second;
+        index_.erase(it);
+        if (pos != members_.size() - 1) {
+            members_[pos].swap(members_.back());
+            ids_[pos] = ids_.back();
+            index_[ids_[pos]] = pos;
+        }
+        members_.pop_back();
+        ids_.pop_back();
+        return true;
+    }
+    size_t size() const
+    {
+        boost::mutex::scoped_lock lk(mutex_);
+        return members_.size();
+    }
+    // true once the room has numbered a message
+    bool numbered() const
+    {
+        boost::mutex::scoped_lock lk(mutex_);
+        return sequence_ != first_sequence_;
+    }
+
+private:
+    bool add_member(id_type id, const session_ptr &session)
+    {
+        if (index_.count(id)) return false;
+        index_[id] = members_.size();
+        members_.push_back(session);
+        ids_.push_back(id);
+        return true;
+    }
+
+private:
+    std::string name_;
+    mutable boost::mutex mutex_;
+    std::vector<session_ptr> members_;
+    std::vector<id_type> ids_;
+    std::unordered_map<id_type, size_t> index_;
+    boost::uint32_t sequence_;
+    boost::uint32_t first_sequence_;
+    std::deque<std::pair<boost::uint32_t, Message> > recent_;
+    size_t max_recent_;
+};
+
+// Rooms by name; sessions keep the room_ptr they joined, so broadcasting never
+// looks the room up again. A room that has numbered messages stays when its
+// last member leaves, with its sequence and its remembered messages: when it
+// fills again (after a reconnect storm, say) numbers are not reused, and a
+// member that resumes later still gets what the earlier ones posted. An
+// emptied room that never numbered anything is dropped; when one is created
+// again it continues from the sequence it is given.
+template <class Session, class SessionPtr = boost::shared_ptr<Session>, class Message = boost::shared_ptr<const std::string> >
+class room_table : boost::noncopyable
+{
+public:
+    typedef room<Session, SessionPtr, Message> room_type;
+    typedef boost::shared_ptr<room_type> room_ptr;
+    typedef typename room_type::session_ptr session_ptr;
+    typedef typename room_type::id_type id_type;
+    typedef typename room_type::catch_up_type catch_up_type;
+
+    explicit room_table(size_t max_recent = 1024) : max_recent_(max_recent) {}
+
+    // returns the room, or null if the session was already in it
+    room_ptr join(const std::string &name, id_type id, const session_ptr &session)
+    {
+        boost::mutex::scoped_lock lk(mutex_);
+        room_ptr &r = rooms_[name];
+        if (!r) r = boost::make_shared<room_type>(name, 0, max_recent_);
+        return r->join(id, session) ? r : room_ptr();
+    }
+    // the same, for a session that has seen the room's messages up to `since`
+    // (see room::join); a new room starts after `sequence`
+    room_ptr join(const std::string &name, id_type id, const session_ptr &session, boost::uint32_t sequence,
+                  boost::uint32_t since, catch_up_type &missed)
+    {
+        boost::mutex::scoped_lock lk(mutex_);
+        room_ptr &r = rooms_[name];
+        if (!r) r = boost::make_shared<room_type>(name, sequence, max_recent_);
+        return r->join(id, session, since, missed) ? r : room_ptr();
+    }
+    void leave(const room_ptr &r, id_type id)
+    {
+        boost::mutex::scoped_lock lk(mutex_);
+        if (!r->leave(id) || r->size() > 0 || r->numbered()) return;
+        typename std::unordered_map<std::string, room_ptr>::iterator it = rooms_.find(r->name());
+        if (it != rooms_.end() && it->second == r) rooms_.erase(it);
+    }
+    room_ptr find(const std::string &name) const
+    {
+        boost::mutex::scoped_lock lk(mutex_);
+        typename std::unordered_map<std::string, room_ptr>::const_iterator it = rooms_.find(name);
+        return it == rooms_.end() ? room_ptr() : it->second;
+    }
+
+private:
+    mutable boost::mutex mutex_;
+    std::unordered_map<std::string, room_ptr> rooms_;
+    size_t max_recent_;
+};
+
+#endif // ROOMS_HPP
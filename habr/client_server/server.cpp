@@ -1,128 +1,83 @@
 #include <boost/asio.hpp>
 #include <boost/bind/bind.hpp>
-#include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/thread.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <iostream>
-#include <vector>
-
-#define BUFFER_SIZE 1024 * 5
+#include "chat_server.hpp"
+#include "metrics_http.hpp"
+#include "server.hpp"
 
 using namespace boost::asio;
 using namespace boost::placeholders;
-io_service service;
 
-class talk_to_client;
-typedef boost::shared_ptr<talk_to_client> client_ptr;
-std::vector<client_ptr> clients;
+// the io_service of the running server_main, for server_shutdown()
+boost::atomic<io_service*> running(0);
 
-class talk_to_client : public boost::enable_shared_from_this<talk_to_client>, boost::noncopyable
+void server_shutdown()
 {
-    typedef talk_to_client self_type;
-    talk_to_client() : sock_(service), started_(false), clients_changed_(false) {}
-public:
-    typedef boost::system::error_code error_code;
-    typedef boost::shared_ptr<talk_to_client> ptr;
-    void start()
-    {
-        started_ = true;
-        clients.push_back(shared_from_this());
-        std::cout << "client fucking started\n";
-        reading();
-    }
-    static ptr new_()
-    {
-        ptr new_(new talk_to_client);
-        return new_;
-    }
-    void stop()
-    {
-        std::cout << "server, stop()\n";
-        if (!started_) return;
-        started_ = false;
-        sock_.close();
-        auto it = std::find(clients.begin(), clients.end(), shared_from_this());
-        clients.erase(it);
-        update_clients_changed();
-    }
-    ip::tcp::socket& sock() { return sock_; }
-    std::string username() const { return username_; }
-    void set_clients_changed() { clients_changed_ = true; }
-    void send_message_public(std::string msg) { send_message(msg); }
+    io_service *service = running.load();
+    if (service) service->stop();
+}
 
-private:
-    void reading()
-    {
-        sock_.async_read_some(buffer(read_buffer_), 
-            boost::bind(&self_type::read_completed, shared_from_this(), _1, _2));
-    }
-    void read_completed(const error_code &err, size_t bytes)
-    {
-        if (err) stop();
-        if (!started_) {
-            std::cerr << "server has been stopped in read_completed\n";
-            return;
-        }
-        // printf("read_buffer: %s\n", read_buffer_);
-        std::string msg(read_buffer_, bytes);
-        std::cout << "server received: " << msg << std::endl;
-        if (msg.find("login:") == 0) {
-            std::string username = msg.substr(6);
-            username_ = username;
-            send_message("hello, " + username + "!");
-        } else {
-            for (auto it = clients.begin(), e = clients.end(); it != e; ++it)
-            {
-                // std::cout << "server, entered rassylka\n";
-                std::cout << (*it)->username();
-                // printf("%s\n", (*it)->username());
-                // fflush(stdout);
-                (*it)->send_message_public(msg);
-            }
-            std::cout << std::endl;
-            // send_message(msg);
-        }
-    }
-    void send_message(std::string msg)
-    {
-        if (!started_) return;
-        std::copy(msg.begin(), msg.end(), write_buffer_);
-        sock_.async_write_some(buffer(write_buffer_, msg.size()), 
-            boost::bind(&self_type::message_sended, shared_from_this(), _1, _2));
-    }
-    void message_sended(const error_code &err, size_t bytes)
-    {
-        reading();
-    }
-    void update_clients_changed()
-    {
-        for(auto b = clients.begin(), e = clients.end(); b != e; ++b)
-        {
-            (*b)->set_clients_changed();
-        }
-    }
+template <class Transport>
+int serve(const typename Transport::endpoint_type &ep, unsigned threads, const outbound_limits &limits, unsigned short admin_port,
+          unsigned acceptors, unsigned pending_accepts, const std::string &history_dir)
+{
+    io_service service;
+    metrics_registry metrics;
+    boost::scoped_ptr<history_log> history;
+    if (!history_dir.empty()) history.reset(new history_log(history_dir, metrics));
+    chat_server<Transport> server(service, metrics, limits, history.get());
+    server.listen(ep, acceptors ? acceptors : threads, pending_accepts);
+    boost::scoped_ptr<metrics_endpoint> admin;
+    if (admin_port) admin.reset(new metrics_endpoint(service, metrics, admin_port));
+    LOG_INFO("server running {} io threads", threads);
 
-private:
-    ip::tcp::socket sock_;
-    bool started_;
-    enum { max_msg = BUFFER_SIZE };
-    char read_buffer_[max_msg];
-    char write_buffer_[max_msg];
-    std::string username_;
-    bool clients_changed_;
-};
+    // a clean exit on SIGINT/SIGTERM (profile-guided builds write their profile then)
+    signal_set signals(service, SIGINT, SIGTERM);
+    signals.async_wait(boost::bind(server_shutdown));
+    running = &service;
+    boost::thread_group pool;
+    for (unsigned i = 0; i < threads; ++i)
+        pool.create_thread(boost::bind(&io_service::run, &service));
+    pool.join_all();
+    running = 0;
+    LOG_INFO("server stopped");
+    return 0;
+}
 
-ip::tcp::acceptor acceptor(service, ip::tcp::endpoint(ip::tcp::v4(), 8001));
-void handle_accept(talk_to_client::ptr client, const talk_to_client::error_code &err)
+int server_main(int argc, char const *argv[])
 {
-    client->start();
-    talk_to_client::ptr new_client = talk_to_client::new_();
-    acceptor.async_accept(new_client->sock(), boost::bind(handle_accept, new_client, _1));
+    // usage: ./server [threads] [drop_oldest|drop_newest|coalesce|disconnect] [max_queued_kb] [max_queued_messages] [admin_port] [listen]
+    //                 [acceptors] [pending_accepts] [history_dir]
+    // threads default to one per core, the outbound limits to 4 MB / 16384 messages, drop_oldest;
+    // metrics are served on 127.0.0.1:<admin_port> (default 9100, 0 turns it off);
+    // listen is a TCP port (default 8001) or unix:<path> for a Unix domain socket;
+    // acceptors is the number of SO_REUSEPORT listening sockets (default 1, 0: one per io thread),
+    // each with pending_accepts accepts outstanding (default 4);
+    // broadcasts are kept in a history log in history_dir when one is given
+    unsigned threads = argc > 1 ? atoi(argv[1]) : boost::thread::hardware_concurrency();
+    if (threads == 0) threads = 1;
+    outbound_limits limits = default_outbound_limits();
+    if (argc > 2 && !parse_overflow_policy(argv[2], limits.policy)) {
+        std::cerr << "unknown overflow policy " << argv[2] << "\n";
+        return 1;
+    }
+    if (argc > 3) limits.max_bytes = atoi(argv[3]) * 1024;
+    if (argc > 4) limits.max_messages = atoi(argv[4]);
+    unsigned short admin_port = argc > 5 ? atoi(argv[5]) : 9100;
+    std::string listen = argc > 6 ? argv[6] : "8001";
+    unsigned acceptors = argc > 7 ? atoi(argv[7]) : 1;
+    unsigned pending_accepts = argc > 8 ? atoi(argv[8]) : 4;
+    std::string history_dir = argc > 9 ? argv[9] : "";
+    if (listen.compare(0, 5, "unix:") == 0)
+        return serve<unix_transport>(local::stream_protocol::endpoint(listen.substr(5)), threads, limits, admin_port, acceptors, pending_accepts, history_dir);
+    return serve<tcp_transport>(ip::tcp::endpoint(ip::tcp::v4(), atoi(listen.c_str())), threads, limits, admin_port, acceptors, pending_accepts, history_dir);
 }
 
+#ifndef CHAT_SERVER_LIBRARY
 int main(int argc, char const *argv[])
 {
-    talk_to_client::ptr client = talk_to_client::new_();
-    acceptor.async_accept(client->sock(), boost::bind(handle_accept, client, _1));
-    service.run();
-    return 0;
-}
\ No newline at end of file
+    return server_main(argc, argv);
+}
+#endif
@@ -0,0 +1,13 @@
+#ifndef SERVER_HPP
+#define SERVER_HPP
+
+// Entry points of the broadcast server when it is linked in as a library
+// (server.cpp compiled with -DCHAT_SERVER_LIBRARY, see `make bench`).
+
+// takes the same arguments as ./server and serves until server_shutdown(),
+// SIGINT or SIGTERM
+int server_main(int argc, char const *argv[]);
+// stops the io threads, server_main returns once they are done
+void server_shutdown();
+
+#endif // SERVER_HPP
@@ -0,0 +1,170 @@
+// The protocol of server_template.cpp served by C++20 coroutines (asio
+// awaitables) instead of chains of callbacks. Every session runs two of them:
+// the reader loops on async_read_some and answers each complete line, the
+// writer sleeps until answers are queued and sends all of them in one write.
+// Neither waits for the other, so pipelined requests keep being read while
+// earlier answers are still on their way out.
+//
+// build: make coro
+#include <utility>  // before asio: awaitable.hpp of Boost 1.74 uses std::exchange without it
+#include <boost/asio.hpp>
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/make_shared.hpp>
+#include <sstream>
+#include "line_reader.hpp"
+#include "presence.hpp"
+#include "session_registry.hpp"
+#include "timer_wheel.hpp"
+
+using namespace boost::asio;
+
+io_service service;
+
+class talk_to_client;
+session_registry<talk_to_client> clients;
+presence members;
+// clients silent for 5 seconds are dropped; checked twice a second
+timer_wheel<talk_to_client> liveness(service, boost::posix_time::millisec(500), 10);
+
+class talk_to_client : public boost::enable_shared_from_this<talk_to_client>, boost::noncopyable
+{
+public:
+    typedef boost::system::error_code error_code;
+    typedef boost::shared_ptr<talk_to_client> ptr;
+
+    explicit talk_to_client(ip::tcp::socket sock)
+        : sock_(std::move(sock)), wakeup_(service), started_(false), last_activity_(0), id_(0), members_version_(0)
+    {
+        // the writer's idle wait; do_write() and stop() cancel it to wake the writer
+        wakeup_.expires_at(boost::posix_time::pos_infin);
+    }
+    // each coroutine holds a reference, the session lives until both have returned
+    void start()
+    {
+        started_ = true;
+        id_ = clients.insert(shared_from_this());
+        last_activity_ = liveness.now();
+        liveness.add(shared_from_this());
+        co_spawn(service, reader(shared_from_this()), detached);
+        co_spawn(service, writer(shared_from_this()), detached);
+    }
+    void stop()
+    {
+        if (!started_) return;
+        started_ = false;
+        error_code ignored;
+        sock_.close(ignored);
+        wakeup_.cancel();
+        clients.remove(id_);
+        if (!username_.empty()) members.leave(username_);
+    }
+    bool started() const { return started_; }
+    unsigned long long last_activity() const { return last_activity_; }
+    void on_idle() { stop(); }
+    std::string username() const { return username_; }
+    bool clients_changed() const { return members_version_ != members.version(); }
+
+private:
+    awaitable<void> reader(ptr self)
+    {
+        error_code err;
+        while (started_) {
+            size_t bytes = co_await sock_.async_read_some(reader_.prepare(), redirect_error(use_awaitable, err));
+            if (err) break;
+            last_activity_ = liveness.now();
+            reader_.commit(bytes);
+            const char *line;
+            size_t length;
+            while (reader_.next(line, length)) on_line(line, length);
+            if (reader_.overflow()) break;
+        }
+        stop();
+    }
+    // answers to several pipelined requests are sent together in one write
+    awaitable<void> writer(ptr self)
+    {
+        error_code err;
+        while (started_) {
+            if (pending_.empty()) {
+                co_await wakeup_.async_wait(redirect_error(use_awaitable, err));
+                continue;
+            }
+            write_buffer_.clear();
+            write_buffer_.swap(pending_);
+            co_await async_write(sock_, buffer(write_buffer_), redirect_error(use_awaitable, err));
+            if (err) break;
+        }
+        stop();
+    }
+    void on_line(const char *line, size_t length)
+    {
+        if (line_starts_with(line, length, "login")) on_login(std::string(line, length));
+        else if (line_starts_with(line, length, "ping")) on_ping();
+        else if (line_starts_with(line, length, "ask_clients")) on_clients(std::string(line, length));
+    }
+    void on_login(const std::string &msg)
+    {
+        std::istringstream in(msg);
+        std::string old = username_;
+        in >> username_ >> username_;
+        clients.set_username(id_, username_);
+        if (!old.empty()) members.leave(old);
+        members.join(username_);
+        do_write("login ok\n");
+    }
+    void on_ping()
+    {
+        do_write(clients_changed() ? "ping client_list_changed\n" : "ping ok\n");
+    }
+    // "ask_clients [version]": the client's copy is at `version`, send what changed since
+    void on_clients(const std::string &msg)
+    {
+        std::istringstream in(msg);
+        std::string cmd;
+        presence::version_type since = 0;
+        in >> cmd >> since;
+        do_write(members.changes_since(since, members_version_));
+    }
+    void do_write(const std::string &msg)
+    {
+        if (!started_) return;
+        pending_ += msg;
+        wakeup_.cancel();
+    }
+
+private:
+    ip::tcp::socket sock_;
+    deadline_timer wakeup_;
+    line_reader reader_;
+    std::string write_buffer_;
+    std::string pending_;
+    bool started_;
+    std::string username_;
+    unsigned long long last_activity_;
+    session_registry<talk_to_client>::id_type id_;
+    presence::version_type members_version_;
+};
+
+awaitable<void> listener()
+{
+    ip::tcp::acceptor acceptor(service, ip::tcp::endpoint(ip::tcp::v4(), 8001));
+    boost::system::error_code err;
+    for (;;) {
+        ip::tcp::socket sock = co_await acceptor.async_accept(redirect_error(use_awaitable, err));
+        if (!err) boost::make_shared<talk_to_client>(std::move(sock))->start();
+    }
+}
+
+int main(int argc, char const *argv[])
+{
+    co_spawn(service, listener(), detached);
+    liveness.start();
+    service.run();
+    return 0;
+}
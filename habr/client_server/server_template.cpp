@@ -3,6 +3,11 @@
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/thread.hpp>
 #include <iostream>
+#include "line_reader.hpp"
+#include "pool.hpp"
+#include "presence.hpp"
+#include "session_registry.hpp"
+#include "timer_wheel.hpp"
 
 using namespace boost::asio;
 
@@ -10,22 +15,31 @@ io_service service;
 
 class talk_to_client;
 typedef boost::shared_ptr<talk_to_client> client_ptr;
-std::vector<client_ptr> clients;
+session_registry<talk_to_client> clients;
+presence members;
+// clients silent for 5 seconds are dropped; checked twice a second
+timer_wheel<talk_to_client> liveness(service, boost::posix_time::millisec(500), 10);
 
 
 
+// Sessions are full duplex: a read is always outstanding, and answers are
+// written as they come, independently of it.
+// A session's own reads and writes capture a plain `this`: it keeps itself
+// alive through self_ from start() until it is stopped and neither is in
+// flight, and their operations are allocated from its handler_memory.
 class talk_to_client : public boost::enable_shared_from_this<talk_to_client>, boost::noncopyable
 {
-    typedef talk_to_client self_type;
-    talk_to_client() : sock_(service), started_(false), timer_(service), clients_changed_(false) {}
+    talk_to_client() : sock_(service), started_(false), reading_(false), writing_(false), last_activity_(0), id_(0), members_version_(0) {}
 public:
     typedef boost::system::error_code error_code;
     typedef boost::shared_ptr<talk_to_client> ptr;
     void start()
     {
         started_ = true;
-        clients.push_back(shared_from_this());
-        last_ping = boost::posix_time::microsec_clock::local_time();
+        self_ = shared_from_this();
+        id_ = clients.insert(self_);
+        last_activity_ = liveness.now();
+        liveness.add(self_);
         do_read();
     }
     static ptr new_() { ptr new_(new talk_to_client); return new_; }
@@ -34,98 +48,118 @@ public:
         if (!started_) return;
         started_ = false;
         sock_.close();
-        ptr self = shared_from_this();
-        std::vector<client_ptr>::iterator it = std::find(clients.begin(), clients.end(), self);
-        clients.erase(it);
-        update_clients_changed();
+        clients.remove(id_);
+        if (!username_.empty()) members.leave(username_);
     }
     bool started() const { return started_; }
+    unsigned long long last_activity() const { return last_activity_; }
+    void on_idle() { stop(); }
     ip::tcp::socket& sock() { return sock_; }
     std::string username() const { return username_; }
-    void set_clients_changed() { clients_changed_ = true; }
+    bool clients_changed() const { return members_version_ != members.version(); }
 
 private:
+    // called last by the read and write handlers of a stopped session (may destroy it)
+    void release_if_idle()
+    {
+        if (started_ || reading_ || writing_) return;
+        ptr last;
+        last.swap(self_);
+    }
     void on_read(const error_code &err, size_t bytes)
     {
+        reading_ = false;
         if (err) stop();
-        if (!started()) return;
-        std::string msg(read_buffer_, bytes);
-        if (msg.find("login") == 0) on_login(msg);
-        else if (msg.find("ping") == 0) on_ping();
-        else if (msg.find("ask_clients") == 0) on_clients();
+        if (started()) process_input(bytes);
+        if (!started()) release_if_idle();
+    }
+    void process_input(size_t bytes)
+    {
+        last_activity_ = liveness.now();
+        reader_.commit(bytes);
+        const char *line;
+        size_t length;
+        while (reader_.next(line, length)) on_line(line, length);
+        // one read is always outstanding, whether or not a write is in flight
+        if (reader_.overflow()) stop();
+        else do_read();
+    }
+    void on_line(const char *line, size_t length)
+    {
+        if (line_starts_with(line, length, "login")) on_login(std::string(line, length));
+        else if (line_starts_with(line, length, "ping")) on_ping();
+        else if (line_starts_with(line, length, "ask_clients")) on_clients(std::string(line, length));
     }
     void on_login(const std::string &msg)
     {
         std::istringstream in(msg);
+        std::string old = username_;
         in >> username_ >> username_;
+        clients.set_username(id_, username_);
+        if (!old.empty()) members.leave(old);
+        members.join(username_);
         do_write("login ok\n");
-        update_clients_changed();
     }
     void on_ping()
     {
-        do_write(clients_changed_ ? "ping client_list_changed\n" : "ping ok\n");
-        clients_changed_ = false;
+        do_write(clients_changed() ? "ping client_list_changed\n" : "ping ok\n");
     }
-    void on_clients()
+    // "ask_clients [version]": the client's copy is at `version`, send what changed since
+    void on_clients(const std::string &msg)
     {
-        std::string msg;
-        for(std::vector<client_ptr>::const_iterator b = clients.begin(), e = clients.end(); b != e; ++b)
-            msg += (*b)->username() + " ";
-        do_write("clients " + msg + "\n");
+        std::istringstream in(msg);
+        std::string cmd;
+        presence::version_type since = 0;
+        in >> cmd >> since;
+        do_write(members.changes_since(since, members_version_));
     }
     void do_ping() { do_write("ping\n"); }
     void do_ask_clients() { do_write("ask_clients\n"); }
-    void on_write(const error_code &err, size_t bytes) { do_read(); }
+    void on_write(const error_code &err, size_t bytes)
+    {
+        writing_ = false;
+        write_buffer_.clear();
+        if (err) stop();
+        else if (!pending_.empty()) write_pending();
+        if (!started()) release_if_idle();
+    }
     void do_read()
     {
-        async_read(sock_, buffer(read_buffer_), 
-            boost::bind(&self_type::read_complete, shared_from_this(), _1, _2), 
-            boost::bind(&self_type::on_read, shared_from_this(), _1, _2));
-        post_check_ping();
+        reading_ = true;
+        sock_.async_read_some(reader_.prepare(),
+            make_alloc_handler(memory_, [this](const error_code &err, size_t bytes) { on_read(err, bytes); }));
     }
+    // answers to several pipelined requests are sent together in one write
     void do_write(const std::string &msg)
     {
         if (!started()) return;
-        std::copy(msg.begin(), msg.end(), write_buffer_);
-        sock_.async_write_some(buffer(write_buffer_, msg.size()), boost::bind(&self_type::on_write, shared_from_this(), _1, _2));
-    }
-    size_t read_complete(const error_code &err, size_t bytes)
-    {
-        if ( err) return 0;
-        bool found = std::find(read_buffer_, read_buffer_ + bytes, '\n') < read_buffer_ + bytes;
-        // we read one-by-one until we get to enter, no buffering
-        return found ? 0 : 1;
-    }
-    void on_check_ping()
-    {
-        boost::posix_time::ptime now = boost::posix_time::microsec_clock::local_time();
-        if ((now - last_ping).total_milliseconds() > 5000) stop();
-        last_ping = boost::posix_time::microsec_clock::local_time();
-    }
-    void post_check_ping()
-    {
-        timer_.expires_from_now(boost::posix_time::millisec(5000));
-        timer_.async_wait(boost::bind(&self_type::on_check_ping, shared_from_this()));
+        pending_ += msg;
+        if (!writing_) write_pending();
     }
-    void update_clients_changed()
+    void write_pending()
     {
-        for(auto b = clients.begin(), e = clients.end(); b != e; ++b)
-        {
-            (*b)->set_clients_changed();
-        }
+        writing_ = true;
+        write_buffer_.swap(pending_);
+        async_write(sock_, buffer(write_buffer_),
+            make_alloc_handler(memory_, [this](const error_code &err, size_t bytes) { on_write(err, bytes); }));
     }
 
 
 private:
     ip::tcp::socket sock_;
-    enum { max_msg = 1024 };
-    char read_buffer_[max_msg];
-    char write_buffer_[max_msg];
+    // the read and the write in flight
+    handler_memory<256, 2> memory_;
+    ptr self_;
+    line_reader reader_;
+    std::string write_buffer_;
+    std::string pending_;
     bool started_;
+    bool reading_;
+    bool writing_;
     std::string username_;
-    deadline_timer timer_;
-    boost::posix_time::ptime last_ping;
-    bool clients_changed_;
+    unsigned long long last_activity_;
+    session_registry<talk_to_client>::id_type id_;
+    presence::version_type members_version_;
 };
 
 
@@ -141,6 +175,7 @@ int main(int argc, char const *argv[])
 {
     talk_to_client::ptr client = talk_to_client::new_();
     acceptor.async_accept(client->sock(), boost::bind(handle_accept, client, _1));
+    liveness.start();
     service.run();
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,164 @@
+#ifndef SESSION_REGISTRY_HPP
+#define SESSION_REGISTRY_HPP
+
+#include <boost/atomic.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Table of live sessions, keyed by connection id and by username.
+// Both keys are sharded by hash, so insert/remove/lookup lock one small shard
+// and cost O(1). Broadcasts iterate an immutable snapshot that is rebuilt at
+// most once per membership change (readers never take a shard lock), so a
+// disconnect storm costs O(1) per disconnect plus one rebuild on the next
+// broadcast instead of O(N) per disconnect.
+template <class Session, class SessionPtr = boost::shared_ptr<Session> >
+class session_registry : boost::noncopyable
+{
+public:
+    typedef SessionPtr session_ptr;
+    typedef unsigned long long id_type;
+    struct snapshot
+    {
+        unsigned long long version;
+        std::vector<session_ptr> sessions;
+    };
+    typedef boost::shared_ptr<const snapshot> snapshot_ptr;
+
+    session_registry() : next_id_(1), version_(1), size_(0) {}
+
+    id_type insert(const session_ptr &session)
+    {
+        id_type id = next_id_++;
+        shard &s = id_shard(id);
+        {
+            boost::mutex::scoped_lock lk(s.mutex);
+            s.ids[id].session = session;
+        }
+        ++size_;
+        ++version_;
+        return id;
+    }
+    void remove(id_type id)
+    {
+        std::string username;
+        {
+            shard &s = id_shard(id);
+            boost::mutex::scoped_lock lk(s.mutex);
+            typename id_map::iterator it = s.ids.find(id);
+            if (it == s.ids.end()) return;
+            username.swap(it->second.username);
+            s.ids.erase(it);
+        }
+        if (!username.empty()) erase_name(username, id);
+        --size_;
+        ++version_;
+    }
+    // (re)binds a username to a live session; the latest login wins a taken name
+    void set_username(id_type id, const std::string &username)
+    {
+        std::string old;
+        {
+            shard &s = id_shard(id);
+            boost::mutex::scoped_lock lk(s.mutex);
+            typename id_map::iterator it = s.ids.find(id);
+            if (it == s.ids.end()) return;
+            old.swap(it->second.username);
+            it->second.username = username;
+        }
+        if (!old.empty()) erase_name(old, id);
+        {
+            shard &s = name_shard(username);
+            boost::mutex::scoped_lock lk(s.mutex);
+            s.names[username] = id;
+        }
+        ++version_;
+    }
+    session_ptr find(id_type id) const
+    {
+        const shard &s = id_shard(id);
+        boost::mutex::scoped_lock lk(s.mutex);
+        typename id_map::const_iterator it = s.ids.find(id);
+        return it == s.ids.end() ? session_ptr() : it->second.session;
+    }
+    session_ptr find(const std::string &username) const
+    {
+        id_type id;
+        {
+            const shard &s = name_shard(username);
+            boost::mutex::scoped_lock lk(s.mutex);
+            typename name_map::const_iterator it = s.names.find(username);
+            if (it == s.names.end()) return session_ptr();
+            id = it->second;
+        }
+        return find(id);
+    }
+    // immutable view of every session, shared by all concurrent broadcasts
+    snapshot_ptr sessions() const
+    {
+        snapshot_ptr snap = boost::atomic_load(&snapshot_);
+        if (snap && snap->version == version_) return snap;
+
+        boost::mutex::scoped_lock lk(rebuild_mutex_);
+        snap = boost::atomic_load(&snapshot_);
+        unsigned long long version = version_;
+        if (snap && snap->version == version) return snap;
+        boost::shared_ptr<snapshot> fresh = boost::make_shared<snapshot>();
+        fresh->version = version;
+        fresh->sessions.reserve(size_);
+        for (size_t i = 0; i < shard_count; ++i) {
+            boost::mutex::scoped_lock shard_lk(shards_[i].mutex);
+            for (typename id_map::const_iterator b = shards_[i].ids.begin(), e = shards_[i].ids.end(); b != e; ++b)
+                fresh->sessions.push_back(b->second.session);
+        }
+        snap = fresh;
+        boost::atomic_store(&snapshot_, snap);
+        return snap;
+    }
+    // bumped on every join, leave and rename
+    unsigned long long version() const { return version_; }
+    size_t size() const { return size_; }
+
+private:
+    struct entry
+    {
+        session_ptr session;
+        std::string username;
+    };
+    typedef std::unordered_map<id_type, entry> id_map;
+    typedef std::unordered_map<std::string, id_type> name_map;
+    struct shard
+    {
+        mutable boost::mutex mutex;
+        id_map ids;
+        name_map names;
+    };
+    enum { shard_count = 16 };
+
+    shard& id_shard(id_type id) { return shards_[id % shard_count]; }
+    const shard& id_shard(id_type id) const { return shards_[id % shard_count]; }
+    shard& name_shard(const std::string &username) { return shards_[boost::hash<std::string>()(username) % shard_count]; }
+    const shard& name_shard(const std::string &username) const { return shards_[boost::hash<std::string>()(username) % shard_count]; }
+    void erase_name(const std::string &username, id_type id)
+    {
+        shard &s = name_shard(username);
+        boost::mutex::scoped_lock lk(s.mutex);
+        typename name_map::iterator it = s.names.find(username);
+        if (it != s.names.end() && it->second == id) s.names.erase(it);
+    }
+
+private:
+    shard shards_[shard_count];
+    boost::atomic<id_type> next_id_;
+    boost::atomic<unsigned long long> version_;
+    boost::atomic<size_t> size_;
+    mutable boost::mutex rebuild_mutex_;
+    mutable snapshot_ptr snapshot_;
+};
+
+#endif // SESSION_REGISTRY_HPP
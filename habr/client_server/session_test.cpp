@@ -0,0 +1,162 @@
+// Checks of session bookkeeping against a chat_server running in this
+// process. Exits with 1 and says why on the first failed check.
+//
+// build and run: make test
+#include <boost/thread.hpp>
+#include <iostream>
+#include <string>
+#include "chat_server.hpp"
+#include "client.hpp"
+#include "test_client.hpp"
+#include "transport.hpp"
+
+namespace
+{
+typedef chat_server<tcp_transport> server_type;
+
+// a chat_server on test_port, run by one io thread
+struct test_server
+{
+    io_service service;
+    metrics_registry metrics;
+    server_type server;
+    boost::thread io;
+
+    test_server() : server(service, metrics)
+    {
+        server.listen(ip::tcp::endpoint(ip::address_v4::loopback(), test_port));
+        io = boost::thread(boost::bind(&io_service::run, &service));
+    }
+    ~test_server()
+    {
+        server.stop();
+        service.stop();
+        io.join();
+    }
+};
+
+// a login under a name another live session holds is refused and closed;
+// the holder keeps the name and goes on being served
+void test_duplicate_login_refused(io_service &client_service)
+{
+    test_server s;
+    test_client holder(client_service, "dup");
+    test_client duplicate(client_service, "dup");
+    check(!duplicate.logged_in() && duplicate.refused(), "the duplicate login is refused");
+
+    test_client other(client_service, "other");
+    other.post("hi");
+    std::string text;
+    check(holder.next_chat(text) && text == "hi", "the holder is still served");
+    // by that round trip the one io thread has finished the refused session's stop()
+    check(s.server.clients().size() == 2, "the refused session is gone from the registry");
+    check(s.server.clients().find("dup").get() != 0, "the name stays the holder's");
+}
+
+// a resuming login takes a name over from a session that has gone silent,
+// but not from one that has just been heard from
+void test_resume_takes_over_half_open(io_service &client_service)
+{
+    test_server s;
+    test_client lively(client_service, "lively");
+    test_client resumed_early(client_service, "lively", frame_resume);
+    check(!resumed_early.logged_in() && resumed_early.refused(), "a resume is refused while the holder is active");
+
+    test_client silent(client_service, "silent");
+    boost::this_thread::sleep(boost::posix_time::millisec(server_type::session_type::half_open_after_ms + 200));
+    test_client resumed(client_service, "silent", frame_resume);
+    check(resumed.logged_in(), "a resume takes over a silent holder");
+    check(silent.refused(), "the silent holder is refused and closed");
+
+    test_client other(client_service, "other");
+    other.post("hi");
+    std::string text;
+    check(resumed.next_chat(text) && text == "hi", "the session that took over is served");
+}
+
+// waits for the server to notice the clients that went away
+void wait_for_sessions(test_server &s, size_t count)
+{
+    while (s.server.clients().size() != count) boost::this_thread::sleep(boost::posix_time::millisec(10));
+}
+
+// everyone drops at once and the room empties; a member that resumes after
+// others came back and posted gets those posts, numbered after the old ones
+void test_resume_after_room_emptied(io_service &client_service)
+{
+    test_server s;
+    std::string text;
+    {
+        test_client first(client_service, "first");
+        test_client second(client_service, "second");
+        first.post("one");
+        check(second.next_chat(text) && text == "one", "the first post arrives");
+    }
+    wait_for_sessions(s, 0);
+    test_client first(client_service, "first", frame_resume, 1);
+    first.post("two");
+    check(first.next_chat(text) && text == "two", "the post after the storm arrives");
+    test_client second(client_service, "second", frame_resume, 1);
+    check(second.caught_up().size() == 1 && second.caught_up()[0] == "two", "a later resume gets what was posted since");
+}
+
+// what the network thread has handed to the "GUI" so far, appended to `lines`
+void poll(const talk_to_svr::ptr &client, std::vector<chat_line> &lines)
+{
+    client->poll_incoming([&](const chat_line &line) { lines.push_back(line); });
+}
+bool received(const std::vector<chat_line> &lines, const std::string &text)
+{
+    for (std::vector<chat_line>::const_iterator it = lines.begin(); it != lines.end(); ++it)
+        if (it->text.find(text) != std::string::npos) return true;
+    return false;
+}
+
+// two auto-reconnecting GUI clients under one name: the second is refused and
+// stays down, instead of the two taking the name from each other every second
+void test_reconnecting_twins(io_service &client_service)
+{
+    test_server s;
+    io_service::work work(service);
+    boost::thread network(boost::bind(&io_service::run, &service));
+    ip::tcp::endpoint ep(ip::address_v4::loopback(), test_port);
+
+    talk_to_svr::ptr first = talk_to_svr::start(ep, "twin");
+    std::vector<chat_line> first_lines, second_lines;
+    while (!received(first_lines, "hello")) {
+        boost::this_thread::sleep(boost::posix_time::millisec(10));
+        poll(first, first_lines);
+    }
+    talk_to_svr::ptr second = talk_to_svr::start(ep, "twin");
+    // long enough for two reconnects of a client that would come back
+    boost::this_thread::sleep(boost::posix_time::millisec(3500));
+    poll(second, second_lines);
+    check(!second->started() && received(second_lines, "taken"), "the second client is refused and stops");
+    check(first->started(), "the first client keeps its connection");
+    check(s.server.stats().connections_total.value() == 2, "neither client reconnects");
+
+    test_client other(client_service, "other");
+    other.post("still here");
+    while (!received(first_lines, "still here")) {
+        boost::this_thread::sleep(boost::posix_time::millisec(10));
+        poll(first, first_lines);
+    }
+
+    service.post(boost::bind(&talk_to_svr::stop, first));
+    service.stop();
+    network.join();
+}
+}
+
+int main()
+{
+    // the clients block; a frame that never comes fails the run instead of hanging it
+    alarm(test_timeout);
+    io_service client_service;
+    test_duplicate_login_refused(client_service);
+    test_resume_takes_over_half_open(client_service);
+    test_resume_after_room_emptied(client_service);
+    test_reconnecting_twins(client_service);
+    std::cout << "session_test: ok" << std::endl;
+    return 0;
+}
@@ -0,0 +1,85 @@
+#ifndef TEST_CLIENT_HPP
+#define TEST_CLIENT_HPP
+
+#include <boost/asio.hpp>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include "frame.hpp"
+
+// Helpers of the *_test.cpp programs, which run a chat_server on test_port
+// in their own process and talk to it over blocking sockets.
+
+const unsigned short test_port = 8011;
+// seconds a test program may run, see alarm()
+const unsigned test_timeout = 30;
+
+inline void check(bool ok, const std::string &what)
+{
+    if (ok) return;
+    std::cerr << "FAILED: " << what << std::endl;
+    exit(1);
+}
+
+// a blocking client speaking the frame protocol
+class test_client
+{
+public:
+    // logs in and reads up to the hello, or the refusal; `flags` and `since` go on the login
+    test_client(boost::asio::io_service &service, const std::string &username, boost::uint16_t flags = 0, boost::uint32_t since = 0)
+        : sock_(service), logged_in_(false), refused_(false)
+    {
+        sock_.connect(boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), test_port));
+        send(encode_frame(frame_login, since, username.data(), username.size(), flags));
+        frame f;
+        std::string sender, room, text;
+        while (!logged_in_ && !refused_ && next(f)) {
+            logged_in_ = f.header.type == frame_hello;
+            refused_ = f.header.type == frame_refused;
+            if (f.header.type == frame_chat && decode_chat(f, sender, room, text)) caught_up_.push_back(text);
+        }
+    }
+    bool logged_in() const { return logged_in_; }
+    // the chat texts that came ahead of the hello: a resume's catch-up
+    const std::vector<std::string>& caught_up() const { return caught_up_; }
+    void send(const frame_ptr &f) { boost::asio::write(sock_, boost::asio::buffer(*f)); }
+    void post(const std::string &text) { send(encode_post(0, default_room, text.data(), text.size())); }
+    // false when the connection is closed
+    bool next(frame &f)
+    {
+        for (;;) {
+            if (decoder_.next(f)) return true;
+            boost::system::error_code err;
+            size_t bytes = sock_.read_some(decoder_.prepare(), err);
+            if (err) return false;
+            decoder_.commit(bytes);
+        }
+    }
+    // reads to the end of the connection; true if the server refused the session on the way
+    bool refused()
+    {
+        frame f;
+        while (next(f)) refused_ = refused_ || f.header.type == frame_refused;
+        return refused_;
+    }
+    // the text of the next chat frame, reading past anything else
+    bool next_chat(std::string &text)
+    {
+        frame f;
+        std::string sender, room;
+        while (next(f))
+            if (f.header.type == frame_chat && decode_chat(f, sender, room, text)) return true;
+        return false;
+    }
+
+private:
+    boost::asio::ip::tcp::socket sock_;
+    frame_decoder decoder_;
+    bool logged_in_;
+    bool refused_;
+    std::vector<std::string> caught_up_;
+};
+
+#endif // TEST_CLIENT_HPP
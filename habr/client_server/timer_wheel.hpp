@@ -0,0 +1,70 @@
+#ifndef TIMER_WHEEL_HPP
+#define TIMER_WHEEL_HPP
+
+#include <boost/asio.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/weak_ptr.hpp>
+#include <vector>
+
+// Hashed timing wheel for connection liveness, one per io_service.
+// Sessions only store the tick of their last activity (a plain integer copy of
+// now()); the wheel owns a single deadline_timer that advances one slot per tick
+// and checks the sessions hashed into it. A session that was active since it
+// was filed is re-filed at its new deadline, an idle one gets on_idle().
+// Deadlines further away than the wheel span simply wrap and are re-checked,
+// so no per-session timer or timer-queue rebalancing is ever involved.
+//
+// Session needs: bool started() const, unsigned long long last_activity() const, void on_idle()
+template <class Session>
+class timer_wheel : boost::noncopyable
+{
+public:
+    typedef boost::shared_ptr<Session> session_ptr;
+    typedef unsigned long long tick_type;
+
+    timer_wheel(boost::asio::io_service &service, boost::posix_time::time_duration tick, tick_type timeout_ticks, size_t slots = 64)
+        : timer_(service), tick_(tick), timeout_(timeout_ticks), now_(0), slots_(slots) {}
+
+    void start() { arm(); }
+    void stop() { timer_.cancel(); }
+    // the coarse clock sessions stamp their activity with
+    tick_type now() const { return now_; }
+    void add(const session_ptr &session) { file(session, now_ + timeout_); }
+
+private:
+    void arm()
+    {
+        timer_.expires_from_now(tick_);
+        timer_.async_wait(boost::bind(&timer_wheel::on_tick, this, boost::asio::placeholders::error));
+    }
+    void on_tick(const boost::system::error_code &err)
+    {
+        if (err) return;
+        ++now_;
+        std::vector<boost::weak_ptr<Session> > due;
+        due.swap(slots_[now_ % slots_.size()]);
+        for (typename std::vector<boost::weak_ptr<Session> >::iterator b = due.begin(), e = due.end(); b != e; ++b) {
+            session_ptr s = b->lock();
+            if (!s || !s->started()) continue;
+            tick_type deadline = s->last_activity() + timeout_;
+            if (deadline <= now_) s->on_idle();
+            else file(s, deadline);
+        }
+        arm();
+    }
+    void file(const session_ptr &session, tick_type deadline)
+    {
+        slots_[deadline % slots_.size()].push_back(session);
+    }
+
+private:
+    boost::asio::deadline_timer timer_;
+    boost::posix_time::time_duration tick_;
+    tick_type timeout_;
+    tick_type now_;
+    std::vector<std::vector<boost::weak_ptr<Session> > > slots_;
+};
+
+#endif // TIMER_WHEEL_HPP
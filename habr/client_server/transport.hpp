@@ -0,0 +1,453 @@
+#ifndef TRANSPORT_HPP
+#define TRANSPORT_HPP
+
+#include <boost/asio.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/optional.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <map>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+// Transports chat_server<> and the clients can run over. Each one names a
+// socket, an acceptor and an endpoint type with the asio socket interface
+// (async_connect, async_read_some, async_write_some, close), plus listen() to
+// open an acceptor on an endpoint and accepted() to set up a new connection.
+// Only transports with can_share_endpoint may have several acceptors listen
+// on the same endpoint.
+
+struct tcp_transport
+{
+    typedef boost::asio::ip::tcp::socket socket_type;
+    typedef boost::asio::ip::tcp::acceptor acceptor_type;
+    typedef boost::asio::ip::tcp::endpoint endpoint_type;
+    typedef boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port;
+    enum { can_share_endpoint = 1 };
+
+    // with `shared`, every acceptor on ep gets its own accept queue and the
+    // kernel spreads incoming connections over them (SO_REUSEPORT)
+    static void listen(acceptor_type &acceptor, const endpoint_type &ep, bool shared = false)
+    {
+        acceptor.open(ep.protocol());
+        acceptor.set_option(acceptor_type::reuse_address(true));
+        if (shared) acceptor.set_option(reuse_port(true));
+        acceptor.bind(ep);
+        acceptor.listen();
+    }
+    // small frames go out at once instead of waiting for the peer's delayed ack;
+    // non-blocking, as sessions wait for input before they read it
+    static void accepted(socket_type &sock)
+    {
+        boost::system::error_code ignored;
+        sock.set_option(boost::asio::ip::tcp::no_delay(true), ignored);
+        sock.non_blocking(true, ignored);
+    }
+};
+
+struct unix_transport
+{
+    typedef boost::asio::local::stream_protocol::socket socket_type;
+    typedef boost::asio::local::stream_protocol::acceptor acceptor_type;
+    typedef boost::asio::local::stream_protocol::endpoint endpoint_type;
+    enum { can_share_endpoint = 0 };
+
+    // a socket file left over by a previous run would make bind() fail
+    static void listen(acceptor_type &acceptor, const endpoint_type &ep, bool = false)
+    {
+        ::unlink(ep.path().c_str());
+        acceptor.open(ep.protocol());
+        acceptor.bind(ep);
+        acceptor.listen();
+    }
+    static void accepted(socket_type &sock)
+    {
+        boost::system::error_code ignored;
+        sock.non_blocking(true, ignored);
+    }
+};
+
+// One direction of an in-process connection: bytes written by one socket,
+// waiting to be read by its peer. At most `capacity` bytes are buffered, a
+// write beyond that waits for the reader like a full socket buffer would.
+class loopback_pipe : boost::noncopyable
+{
+public:
+    typedef boost::system::error_code error_code;
+    typedef boost::function<void(const error_code&, size_t)> handler_type;
+    enum { capacity = 256 * 1024 };
+
+    loopback_pipe() : begin_(0), reader_closed_(false), writer_closed_(false), read_wait_(false) {}
+
+    template <class Buffers>
+    void read(boost::asio::io_service &service, const Buffers &buffers, const handler_type &handler)
+    {
+        boost::mutex::scoped_lock lk(mutex_);
+        read_buffers_.assign(boost::asio::buffer_sequence_begin(buffers), boost::asio::buffer_sequence_end(buffers));
+        read_wait_ = false;
+        start_read(service, handler);
+    }
+    // completes with 0 bytes once there is something to read (or eof)
+    void wait(boost::asio::io_service &service, const handler_type &handler)
+    {
+        boost::mutex::scoped_lock lk(mutex_);
+        read_buffers_.clear();
+        read_wait_ = true;
+        start_read(service, handler);
+    }
+    // reads what is there without waiting: would_block when the pipe is empty
+    template <class Buffers>
+    size_t read_now(const Buffers &buffers, error_code &err)
+    {
+        boost::mutex::scoped_lock lk(mutex_);
+        size_t copied = copy_out(boost::asio::buffer_sequence_begin(buffers), boost::asio::buffer_sequence_end(buffers));
+        if (copied) err = error_code();
+        else if (reader_closed_) err = boost::asio::error::bad_descriptor;
+        else if (writer_closed_) err = boost::asio::error::eof;
+        else err = boost::asio::error::would_block;
+        if (copied && write_handler_) drain_writer();
+        return copied;
+    }
+    template <class Buffers>
+    void write(boost::asio::io_service &service, const Buffers &buffers, const handler_type &handler)
+    {
+        boost::mutex::scoped_lock lk(mutex_);
+        write_buffers_.assign(boost::asio::buffer_sequence_begin(buffers), boost::asio::buffer_sequence_end(buffers));
+        write_handler_ = handler;
+        write_service_ = &service;
+        write_work_.emplace(service);
+        if (reader_closed_) complete_write(boost::asio::error::broken_pipe, 0);
+        else if (writer_closed_) complete_write(boost::asio::error::operation_aborted, 0);
+        else drain_writer();
+    }
+    // the reading socket was closed: its pending read is aborted, writes fail
+    void close_reader()
+    {
+        boost::mutex::scoped_lock lk(mutex_);
+        reader_closed_ = true;
+        data_.clear();
+        begin_ = 0;
+        if (read_handler_) complete_read(boost::asio::error::operation_aborted, 0);
+        if (write_handler_) complete_write(boost::asio::error::broken_pipe, 0);
+    }
+    // the writing socket was closed: the reader gets eof once it drained the pipe
+    void close_writer()
+    {
+        boost::mutex::scoped_lock lk(mutex_);
+        writer_closed_ = true;
+        if (write_handler_) complete_write(boost::asio::error::operation_aborted, 0);
+        if (read_handler_) fill_reader();
+    }
+
+private:
+    // the mutex is held by every caller of the helpers below
+    void start_read(boost::asio::io_service &service, const handler_type &handler)
+    {
+        read_handler_ = handler;
+        read_service_ = &service;
+        read_work_.emplace(service);
+        if (reader_closed_) complete_read(boost::asio::error::operation_aborted, 0);
+        else if (data_.size() > begin_ || writer_closed_) fill_reader();
+    }
+    template <class Iterator>
+    size_t copy_out(Iterator begin, Iterator end)
+    {
+        size_t copied = 0;
+        for (Iterator it = begin; it != end && begin_ < data_.size(); ++it) {
+            size_t n = boost::asio::buffer_copy(boost::asio::mutable_buffer(*it), boost::asio::buffer(data_.data() + begin_, data_.size() - begin_));
+            begin_ += n;
+            copied += n;
+        }
+        if (begin_ == data_.size()) {
+            data_.clear();
+            begin_ = 0;
+        }
+        return copied;
+    }
+    void fill_reader()
+    {
+        if (read_wait_) {
+            complete_read(error_code(), 0);
+            return;
+        }
+        size_t copied = copy_out(read_buffers_.begin(), read_buffers_.end());
+        if (copied == 0 && !writer_closed_) return;
+        complete_read(copied ? error_code() : boost::asio::error::eof, copied);
+        if (write_handler_) drain_writer();
+    }
+    void drain_writer()
+    {
+        size_t room = capacity - std::min<size_t>(capacity, data_.size() - begin_);
+        if (room == 0) return;
+        size_t written = 0;
+        for (std::vector<boost::asio::const_buffer>::iterator it = write_buffers_.begin(), e = write_buffers_.end(); it != e && written < room; ++it) {
+            size_t n = std::min(it->size(), room - written);
+            data_.append(static_cast<const char*>(it->data()), n);
+            written += n;
+        }
+        complete_write(error_code(), written);
+        if (read_handler_) fill_reader();
+    }
+    void complete_read(const error_code &err, size_t bytes)
+    {
+        handler_type handler;
+        handler.swap(read_handler_);
+        read_service_->post(boost::bind(handler, err, bytes));
+        read_work_ = boost::none;
+    }
+    void complete_write(const error_code &err, size_t bytes)
+    {
+        handler_type handler;
+        handler.swap(write_handler_);
+        write_service_->post(boost::bind(handler, err, bytes));
+        write_work_ = boost::none;
+    }
+
+private:
+    boost::mutex mutex_;
+    std::string data_;
+    size_t begin_;
+    bool reader_closed_;
+    bool writer_closed_;
+    bool read_wait_;
+    std::vector<boost::asio::mutable_buffer> read_buffers_;
+    handler_type read_handler_;
+    boost::asio::io_service *read_service_;
+    // a pending operation keeps its io_service running, as a socket's would
+    boost::optional<boost::asio::io_service::work> read_work_;
+    std::vector<boost::asio::const_buffer> write_buffers_;
+    handler_type write_handler_;
+    boost::asio::io_service *write_service_;
+    boost::optional<boost::asio::io_service::work> write_work_;
+};
+
+// in-process endpoints are names, looked up among the listening loopback acceptors
+class loopback_endpoint
+{
+public:
+    explicit loopback_endpoint(const std::string &name = "chat") : name_(name) {}
+    const std::string& name() const { return name_; }
+
+private:
+    std::string name_;
+};
+
+class loopback_acceptor;
+
+// A connected pair of these behaves like two ends of a TCP connection, without
+// the kernel: a write is a memcpy into the peer's pipe, completions are posted
+// to the owning io_service. Lets benchmarks measure the protocol alone.
+class loopback_socket : boost::noncopyable
+{
+public:
+    typedef boost::system::error_code error_code;
+    typedef boost::asio::io_service::executor_type executor_type;
+
+    explicit loopback_socket(boost::asio::io_service &service) : service_(service) {}
+    ~loopback_socket() { close(); }
+
+    executor_type get_executor() { return service_.get_executor(); }
+    bool is_open() const { return in_ != 0; }
+
+    // handlers are taken by reference like asio's own sockets do: composed
+    // operations (async_write) pass themselves by rvalue next to the buffers
+    // they own, and must not be moved from before the buffers were read
+    template <class Handler>
+    void async_connect(const loopback_endpoint &ep, Handler &&handler);
+    template <class Buffers, class Handler>
+    void async_read_some(const Buffers &buffers, Handler &&handler)
+    {
+        loopback_pipe::handler_type h(dispatcher(std::forward<Handler>(handler)));
+        if (in_) in_->read(service_, buffers, h);
+        else service_.post(boost::bind(h, error_code(boost::asio::error::bad_descriptor), size_t(0)));
+    }
+    template <class Handler>
+    void async_wait(boost::asio::socket_base::wait_type, Handler &&handler)
+    {
+        typename std::decay<Handler>::type waiter(std::forward<Handler>(handler));
+        loopback_pipe::handler_type h([waiter](const error_code &err, size_t) {
+            boost::asio::dispatch(boost::asio::get_associated_executor(waiter), std::bind(waiter, err));
+        });
+        if (in_) in_->wait(service_, h);
+        else service_.post(boost::bind(h, error_code(boost::asio::error::bad_descriptor), size_t(0)));
+    }
+    template <class Buffers>
+    size_t read_some(const Buffers &buffers, error_code &err)
+    {
+        if (in_) return in_->read_now(buffers, err);
+        err = boost::asio::error::bad_descriptor;
+        return 0;
+    }
+    template <class Buffers, class Handler>
+    void async_write_some(const Buffers &buffers, Handler &&handler)
+    {
+        loopback_pipe::handler_type h(dispatcher(std::forward<Handler>(handler)));
+        if (out_) out_->write(service_, buffers, h);
+        else service_.post(boost::bind(h, error_code(boost::asio::error::bad_descriptor), size_t(0)));
+    }
+    void close()
+    {
+        if (in_) in_->close_reader();
+        if (out_) out_->close_writer();
+        in_.reset();
+        out_.reset();
+    }
+    void close(error_code &err)
+    {
+        close();
+        err = error_code();
+    }
+
+private:
+    friend class loopback_acceptor;
+    typedef boost::shared_ptr<loopback_pipe> pipe_ptr;
+
+    // completions run on the handler's associated executor (the strand it was
+    // bound to with bind_executor), as they do for asio's own sockets
+    template <class Handler>
+    static loopback_pipe::handler_type dispatcher(Handler &&handler)
+    {
+        typename std::decay<Handler>::type h(std::forward<Handler>(handler));
+        return [h](const error_code &err, size_t bytes) {
+            boost::asio::dispatch(boost::asio::get_associated_executor(h), std::bind(h, err, bytes));
+        };
+    }
+
+    boost::asio::io_service &service_;
+    pipe_ptr in_;
+    pipe_ptr out_;
+};
+
+class loopback_acceptor : boost::noncopyable
+{
+public:
+    typedef boost::system::error_code error_code;
+    typedef boost::function<void(const error_code&)> handler_type;
+
+    explicit loopback_acceptor(boost::asio::io_service &service) : service_(service) {}
+    ~loopback_acceptor() { close(); }
+
+    void listen(const loopback_endpoint &ep)
+    {
+        boost::mutex::scoped_lock lk(registry_mutex());
+        if (registry().count(ep.name())) throw boost::system::system_error(boost::asio::error::address_in_use);
+        registry()[ep.name()] = this;
+        name_ = ep.name();
+    }
+    void close()
+    {
+        {
+            boost::mutex::scoped_lock lk(registry_mutex());
+            if (name_.empty()) return;
+            registry().erase(name_);
+            name_.clear();
+        }
+        boost::mutex::scoped_lock lk(mutex_);
+        for (std::deque<pending>::iterator it = accepts_.begin(), e = accepts_.end(); it != e; ++it)
+            service_.post(boost::bind(it->handler, error_code(boost::asio::error::operation_aborted)));
+        for (std::deque<pending>::iterator it = connects_.begin(), e = connects_.end(); it != e; ++it)
+            it->socket->service_.post(boost::bind(it->handler, error_code(boost::asio::error::connection_refused)));
+        accepts_.clear();
+        connects_.clear();
+    }
+    void close(error_code &err)
+    {
+        close();
+        err = error_code();
+    }
+    void async_accept(loopback_socket &socket, const handler_type &handler)
+    {
+        boost::mutex::scoped_lock lk(mutex_);
+        pending accept = { &socket, handler, boost::asio::io_service::work(service_) };
+        if (connects_.empty()) {
+            accepts_.push_back(accept);
+            return;
+        }
+        connect_pair(accept, connects_.front());
+        connects_.pop_front();
+    }
+
+    // the client side of async_accept, used by loopback_socket::async_connect
+    static void connect(loopback_socket &socket, const loopback_endpoint &ep, const handler_type &handler)
+    {
+        boost::mutex::scoped_lock lk(registry_mutex());
+        std::map<std::string, loopback_acceptor*>::iterator it = registry().find(ep.name());
+        if (it == registry().end()) {
+            socket.service_.post(boost::bind(handler, error_code(boost::asio::error::connection_refused)));
+            return;
+        }
+        it->second->queue_connect(socket, handler);
+    }
+
+private:
+    struct pending
+    {
+        loopback_socket *socket;
+        handler_type handler;
+        boost::asio::io_service::work work;
+    };
+    void queue_connect(loopback_socket &socket, const handler_type &handler)
+    {
+        boost::mutex::scoped_lock lk(mutex_);
+        pending connect = { &socket, handler, boost::asio::io_service::work(socket.service_) };
+        if (accepts_.empty()) {
+            connects_.push_back(connect);
+            return;
+        }
+        connect_pair(accepts_.front(), connect);
+        accepts_.pop_front();
+    }
+    static void connect_pair(const pending &accept, const pending &connect)
+    {
+        loopback_socket::pipe_ptr up = boost::make_shared<loopback_pipe>(), down = boost::make_shared<loopback_pipe>();
+        accept.socket->in_ = up;
+        accept.socket->out_ = down;
+        connect.socket->in_ = down;
+        connect.socket->out_ = up;
+        accept.socket->service_.post(boost::bind(accept.handler, error_code()));
+        connect.socket->service_.post(boost::bind(connect.handler, error_code()));
+    }
+    static boost::mutex& registry_mutex()
+    {
+        static boost::mutex m;
+        return m;
+    }
+    static std::map<std::string, loopback_acceptor*>& registry()
+    {
+        static std::map<std::string, loopback_acceptor*> r;
+        return r;
+    }
+
+private:
+    boost::asio::io_service &service_;
+    boost::mutex mutex_;
+    std::string name_;
+    std::deque<pending> accepts_;
+    std::deque<pending> connects_;
+};
+
+template <class Handler>
+void loopback_socket::async_connect(const loopback_endpoint &ep, Handler &&handler)
+{
+    loopback_acceptor::connect(*this, ep, loopback_acceptor::handler_type(std::forward<Handler>(handler)));
+}
+
+struct loopback_transport
+{
+    typedef loopback_socket socket_type;
+    typedef loopback_acceptor acceptor_type;
+    typedef loopback_endpoint endpoint_type;
+    enum { can_share_endpoint = 0 };
+
+    static void listen(acceptor_type &acceptor, const endpoint_type &ep, bool = false) { acceptor.listen(ep); }
+    static void accepted(socket_type &) {}
+};
+
+#endif // TRANSPORT_HPP
@@ -0,0 +1,128 @@
+#ifndef CHAT_LOG_HPP
+#define CHAT_LOG_HPP
+
+#include "imgui.h"
+#include <algorithm>
+#include <ctime>
+#include <deque>
+#include "../habr/client_server/message_store.hpp"
+
+// The conversation view: a scrolling child window over a message_store that
+// lays out and draws only the messages in sight. Each message's height
+// (time and sender, then its text wrapped beside them) is measured once and
+// its top kept in tops_, so finding the first visible message is a binary
+// search and a frame costs the same for 50 messages as for 500000. Heights
+// are measured again, in one pass over the store, only when the wrap width or
+// the font size changes. The time goes in a column as wide as "00:00", so
+// measuring a message does not need to format its time.
+// The view sticks to the newest message unless the user has scrolled up.
+class chat_log
+{
+public:
+    chat_log() : first_(0), bottom_(0), width_(0), font_size_(0), time_column_(0) {}
+
+    void draw(const char *id, const message_store &messages, const ImVec2 &size, float font_scale)
+    {
+        // the scrollbar is always there, so it does not change the wrap width when it shows up
+        ImGui::BeginChild(id, size, true, ImGuiWindowFlags_AlwaysVerticalScrollbar);
+        ImGui::SetWindowFontScale(font_scale);
+        bool at_bottom = ImGui::GetScrollY() >= ImGui::GetScrollMaxY();
+        float width = ImGui::GetContentRegionAvail().x;
+        if (width != width_ || ImGui::GetFontSize() != font_size_) {
+            width_ = width;
+            font_size_ = ImGui::GetFontSize();
+            time_column_ = ImGui::CalcTextSize("00:00").x + ImGui::GetStyle().ItemSpacing.x;
+            tops_.clear();
+            first_ = messages.first();
+            bottom_ = 0;
+        }
+        // what the store has dropped goes, and the view stays on the same messages
+        double dropped = forget(messages.first());
+        if (dropped > 0 && !at_bottom) ImGui::SetScrollY(std::max(0.0f, ImGui::GetScrollY() - float(dropped)));
+        measure(messages);
+
+        float start = ImGui::GetCursorPosY();
+        double origin = tops_.empty() ? bottom_ : tops_.front();
+        double top = origin + ImGui::GetScrollY() - start;
+        double end = top + ImGui::GetWindowHeight();
+        size_t k = std::upper_bound(tops_.begin(), tops_.end(), top) - tops_.begin();
+        if (k > 0) --k;
+        for (; k < tops_.size() && tops_[k] < end; ++k) {
+            ImGui::SetCursorPosY(start + float(tops_[k] - origin));
+            draw_message(messages[first_ + k]);
+        }
+        // the full height, for the scrollbar
+        ImGui::SetCursorPosY(start + float(bottom_ - origin));
+        ImGui::Dummy(ImVec2(0, 0));
+        if (at_bottom) ImGui::SetScrollHereY(1.0f);
+        ImGui::EndChild();
+    }
+
+private:
+    // width of what precedes the text on the message's first line
+    float prefix_width(const message_store::message &m) const
+    {
+        float width = time_column_;
+        if (m.sender_length)
+            width += ImGui::CalcTextSize(m.sender, m.sender + m.sender_length).x + ImGui::CalcTextSize(":").x + ImGui::GetStyle().ItemSpacing.x;
+        return width;
+    }
+    float height(const message_store::message &m) const
+    {
+        float wrap = std::max(width_ - prefix_width(m), 1.0f);
+        float text = ImGui::CalcTextSize(m.text, m.text + m.text_length, false, wrap).y;
+        // ImGui puts each line on a whole pixel
+        return float(int(std::max(text, ImGui::GetTextLineHeight()) + ImGui::GetStyle().ItemSpacing.y));
+    }
+    // the same layout height() measures
+    void draw_message(const message_store::message &m) const
+    {
+        float x = ImGui::GetCursorPosX();
+        char time[8];
+        strftime(time, sizeof(time), "%H:%M", localtime(&m.time));
+        ImGui::TextDisabled("%s", time);
+        ImGui::SameLine(x + time_column_);
+        if (m.sender_length) {
+            ImGui::TextUnformatted(m.sender, m.sender + m.sender_length);
+            ImGui::SameLine(0, 0);
+            ImGui::TextUnformatted(":");
+            ImGui::SameLine();
+        }
+        ImGui::PushTextWrapPos(0.0f);
+        ImGui::TextUnformatted(m.text, m.text + m.text_length);
+        ImGui::PopTextWrapPos();
+    }
+    // drops the tops of messages before `first`, returns their height
+    double forget(unsigned long long first)
+    {
+        if (first <= first_) return 0;
+        size_t n = std::min<unsigned long long>(first - first_, tops_.size());
+        double dropped = 0;
+        if (n > 0) {
+            dropped = (n < tops_.size() ? tops_[n] : bottom_) - tops_.front();
+            tops_.erase(tops_.begin(), tops_.begin() + n);
+        }
+        first_ = first;
+        return dropped;
+    }
+    // the messages appended since the last frame
+    void measure(const message_store &messages)
+    {
+        for (unsigned long long n = first_ + tops_.size(); n < messages.end(); ++n) {
+            tops_.push_back(bottom_);
+            bottom_ += height(messages[n]);
+        }
+    }
+
+private:
+    // tops_[k] is the top of message first_ + k, bottom_ the end of the last one,
+    // both counted from the first message measured since the layout last changed
+    unsigned long long first_;
+    std::deque<double> tops_;
+    double bottom_;
+    float width_;
+    float font_size_;
+    float time_column_;
+};
+
+#endif // CHAT_LOG_HPP
@@ -5,6 +5,7 @@
 
 #include <stdio.h>
 #include "../habr/client_server/client.hpp"
+#include "chat_log.hpp"
 
 #ifndef BUFFER_SIZE
 #error size of buffer not defined!!!
@@ -15,8 +16,15 @@ static void glfw_error_callback(int error, const char* description)
     fprintf(stderr, "GLFW Error %d: %s\n", error, description);
 }
 
-bool is_locked = false;
 unsigned long long int count = 0;
+// set while the window exists, glfwPostEmptyEvent() needs GLFW initialized
+boost::atomic<bool> gui_running(false);
+
+// network thread: new messages are waiting in the client's incoming queue
+void wake_gui()
+{
+    if (gui_running) glfwPostEmptyEvent();
+}
 
 void Chat(bool *p_open, boost::shared_ptr<talk_to_svr> &session)
 {
@@ -33,6 +41,9 @@ void Chat(bool *p_open, boost::shared_ptr<talk_to_svr> &session)
     static bool no_bring_to_front = false;
     static bool unsaved_document = false;
 
+    message_store &messages = session->messages();
+    session->poll_incoming([&messages](const chat_line &line) { messages.append(line.sender, line.text, line.time); });
+
     ImGuiWindowFlags window_flags = 0;
     if (no_titlebar)        window_flags |= ImGuiWindowFlags_NoTitleBar;
     if (no_scrollbar)       window_flags |= ImGuiWindowFlags_NoScrollbar;
@@ -65,20 +76,17 @@ void Chat(bool *p_open, boost::shared_ptr<talk_to_svr> &session)
     float scale_val = 1.5;
     ImGui::SetWindowFontScale(scale_val);
 
-    // static char outputtext[BUFFER_SIZE] = "";
-    static ImGuiInputTextFlags flags_output = ImGuiInputTextFlags_ReadOnly;
-    ImGui::InputTextMultiline("##output_message", session->get_screen_buffer(), BUFFER_SIZE, ImVec2(-FLT_MIN, ImGui::GetTextLineHeight() * 25), flags_output);
+    // the conversation; only the messages in view are laid out
+    static chat_log output;
+    output.draw("##output_message", messages, ImVec2(-FLT_MIN, ImGui::GetTextLineHeight() * 25), scale_val);
 
     // static char inputtext[BUFFER_SIZE] = "please, type your message\n";
     static ImGuiInputTextFlags flags_input = ImGuiInputTextFlags_AllowTabInput | ImGuiInputTextFlags_CtrlEnterForNewLine;
-    if (!is_locked) {session->get_mutex().lock(); is_locked = true;}
     ImGui::InputTextMultiline("##input_message", session->get_write_buffer(), BUFFER_SIZE, ImVec2(-FLT_MIN, ImGui::GetTextLineHeight() * 2), flags_input);
     // if (count % 60 == 0) printf("%s\n", session->get_write_buffer());
-    // session->get_mutex().unlock();
-    if ((ImGui::Button("send_message") || ImGui::IsKeyPressed(ImGuiKey_Enter)) && is_locked) {
-        session->get_mutex().unlock();
-        is_locked = false;
-    }
+    // the text stays in the box if the outgoing queue is full
+    if ((ImGui::Button("send_message") || ImGui::IsKeyPressed(ImGuiKey_Enter)) && session->send_message(session->get_write_buffer()))
+        session->get_write_buffer()[0] = '\0';
     count++;
 
     ImGui::End();
@@ -109,10 +117,12 @@ int graphical_part(boost::shared_ptr<talk_to_svr> &client)
     ImGui_ImplOpenGL3_Init(glsl_version);
 
     ImVec4 clear_color = ImVec4(0.45f, 0.55f, 0.60f, 1.00f);
+    gui_running = true;
 
     while (!glfwWindowShouldClose(window))
     {
-        glfwPollEvents();
+        // sleeps until input, a message (wake_gui) or the next cursor blink
+        glfwWaitEventsTimeout(0.25);
         ImGui_ImplOpenGL3_NewFrame();
         ImGui_ImplGlfw_NewFrame();
         ImGui::NewFrame();
@@ -130,6 +140,7 @@ int graphical_part(boost::shared_ptr<talk_to_svr> &client)
 
         glfwSwapBuffers(window);
     }
+    gui_running = false;
     return 0;
 }
 void start_network()
@@ -148,6 +159,9 @@ int main(int argc, char const *argv[])
     }
     const std::string name(argv[1]);
     boost::shared_ptr<talk_to_svr> client = talk_to_svr::start(ep, name);
+    client->on_incoming(wake_gui);
+    // how many of the latest messages the window keeps, 100000 by default
+    if (argc > 2) client->messages().set_retention(atoi(argv[2]));
 
     auto thread = boost::thread(start_network);
     graphical_part(client);